@@ -1,11 +1,20 @@
+#ifndef _WIN32
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <inttypes.h>
 #include <string.h>
+#include <math.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdarg.h>
 
 #ifdef _WIN32
 #include <windows.h>
+#include <io.h>
 /*
  * Load MSP430.DLL at runtime via LoadLibrary/GetProcAddress.
  * This avoids needing an import library and sidesteps the 32-bit
@@ -18,20 +27,52 @@
 #define DLL430_SYMBOL  /* suppress __declspec(dllimport) */
 #else
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <termios.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
 #endif
 
 #include <MSP430.h>
 #include <MSP430_EnergyTrace.h>
 #include <MSP430_Debug.h>
+#include <MSP430_EEM.h>
 
 #ifdef _WIN32
 /* Function pointer types */
 typedef STATUS_T (WINAPI *pfn_MSP430_Initialize)(const char*, int32_t*);
 typedef STATUS_T (WINAPI *pfn_MSP430_Close)(int32_t);
 typedef STATUS_T (WINAPI *pfn_MSP430_VCC)(int32_t);
+typedef STATUS_T (WINAPI *pfn_MSP430_Configure)(int32_t, int32_t);
 typedef STATUS_T (WINAPI *pfn_MSP430_OpenDevice)(const char*, const char*, int32_t, int32_t, int32_t);
 typedef STATUS_T (WINAPI *pfn_MSP430_GetFoundDevice)(uint8_t*, int32_t);
 typedef STATUS_T (WINAPI *pfn_MSP430_Run)(int32_t, int32_t);
+typedef STATUS_T (WINAPI *pfn_MSP430_Reset)(int32_t, int32_t, int32_t);
+typedef STATUS_T (WINAPI *pfn_MSP430_ProgramFile)(const char*, int32_t, int32_t);
+typedef STATUS_T (WINAPI *pfn_MSP430_State)(int32_t*, int32_t, int32_t*);
+typedef STATUS_T (WINAPI *pfn_MSP430_Register)(int32_t*, int32_t, int32_t);
+typedef STATUS_T (WINAPI *pfn_MSP430_Memory)(int32_t, uint8_t*, int32_t, int32_t);
+typedef STATUS_T (WINAPI *pfn_MSP430_EEM_Init)(MSP430_EVENTNOTIFY_FUNC, int32_t, const MessageID_t*);
+typedef STATUS_T (WINAPI *pfn_MSP430_EEM_SetBreakpoint)(uint16_t*, const BpParameter_t*);
+typedef STATUS_T (WINAPI *pfn_MSP430_EEM_SetCycleCounterMode)(CycleCounterMode_t);
+typedef STATUS_T (WINAPI *pfn_MSP430_EEM_ConfigureCycleCounter)(uint32_t, CycleCounterConfig_t);
+typedef STATUS_T (WINAPI *pfn_MSP430_EEM_ReadCycleCounterValue)(uint32_t, uint64_t*);
+typedef STATUS_T (WINAPI *pfn_MSP430_EEM_ResetCycleCounter)(uint32_t);
 typedef STATUS_T (WINAPI *pfn_MSP430_EnableEnergyTrace)(const EnergyTraceSetup*, const EnergyTraceCallbacks*, EnergyTraceHandle*);
 typedef STATUS_T (WINAPI *pfn_MSP430_DisableEnergyTrace)(const EnergyTraceHandle);
 typedef STATUS_T (WINAPI *pfn_MSP430_ResetEnergyTrace)(const EnergyTraceHandle);
@@ -42,9 +83,21 @@ typedef const char* (WINAPI *pfn_MSP430_Error_String)(int32_t);
 static pfn_MSP430_Initialize        pMSP430_Initialize;
 static pfn_MSP430_Close             pMSP430_Close;
 static pfn_MSP430_VCC               pMSP430_VCC;
+static pfn_MSP430_Configure         pMSP430_Configure;
 static pfn_MSP430_OpenDevice        pMSP430_OpenDevice;
 static pfn_MSP430_GetFoundDevice    pMSP430_GetFoundDevice;
 static pfn_MSP430_Run               pMSP430_Run;
+static pfn_MSP430_Reset             pMSP430_Reset;
+static pfn_MSP430_ProgramFile       pMSP430_ProgramFile;
+static pfn_MSP430_State             pMSP430_State;
+static pfn_MSP430_Register          pMSP430_Register;
+static pfn_MSP430_Memory            pMSP430_Memory;
+static pfn_MSP430_EEM_Init          pMSP430_EEM_Init;
+static pfn_MSP430_EEM_SetBreakpoint pMSP430_EEM_SetBreakpoint;
+static pfn_MSP430_EEM_SetCycleCounterMode pMSP430_EEM_SetCycleCounterMode;
+static pfn_MSP430_EEM_ConfigureCycleCounter pMSP430_EEM_ConfigureCycleCounter;
+static pfn_MSP430_EEM_ReadCycleCounterValue pMSP430_EEM_ReadCycleCounterValue;
+static pfn_MSP430_EEM_ResetCycleCounter pMSP430_EEM_ResetCycleCounter;
 static pfn_MSP430_EnableEnergyTrace pMSP430_EnableEnergyTrace;
 static pfn_MSP430_DisableEnergyTrace pMSP430_DisableEnergyTrace;
 static pfn_MSP430_ResetEnergyTrace  pMSP430_ResetEnergyTrace;
@@ -56,9 +109,21 @@ static pfn_MSP430_Error_String      pMSP430_Error_String;
 #define MSP430_Initialize        pMSP430_Initialize
 #define MSP430_Close             pMSP430_Close
 #define MSP430_VCC               pMSP430_VCC
+#define MSP430_Configure         pMSP430_Configure
 #define MSP430_OpenDevice        pMSP430_OpenDevice
 #define MSP430_GetFoundDevice    pMSP430_GetFoundDevice
 #define MSP430_Run               pMSP430_Run
+#define MSP430_Reset             pMSP430_Reset
+#define MSP430_ProgramFile       pMSP430_ProgramFile
+#define MSP430_State             pMSP430_State
+#define MSP430_Register          pMSP430_Register
+#define MSP430_Memory            pMSP430_Memory
+#define MSP430_EEM_Init          pMSP430_EEM_Init
+#define MSP430_EEM_SetBreakpoint pMSP430_EEM_SetBreakpoint
+#define MSP430_EEM_SetCycleCounterMode pMSP430_EEM_SetCycleCounterMode
+#define MSP430_EEM_ConfigureCycleCounter pMSP430_EEM_ConfigureCycleCounter
+#define MSP430_EEM_ReadCycleCounterValue pMSP430_EEM_ReadCycleCounterValue
+#define MSP430_EEM_ResetCycleCounter pMSP430_EEM_ResetCycleCounter
 #define MSP430_EnableEnergyTrace pMSP430_EnableEnergyTrace
 #define MSP430_DisableEnergyTrace pMSP430_DisableEnergyTrace
 #define MSP430_ResetEnergyTrace  pMSP430_ResetEnergyTrace
@@ -88,9 +153,21 @@ static int LoadMSP430(void) {
 	LOAD(MSP430_Initialize);
 	LOAD(MSP430_Close);
 	LOAD(MSP430_VCC);
+	LOAD(MSP430_Configure);
 	LOAD(MSP430_OpenDevice);
 	LOAD(MSP430_GetFoundDevice);
 	LOAD(MSP430_Run);
+	LOAD(MSP430_Reset);
+	LOAD(MSP430_ProgramFile);
+	LOAD(MSP430_State);
+	LOAD(MSP430_Register);
+	LOAD(MSP430_Memory);
+	LOAD(MSP430_EEM_Init);
+	LOAD(MSP430_EEM_SetBreakpoint);
+	LOAD(MSP430_EEM_SetCycleCounterMode);
+	LOAD(MSP430_EEM_ConfigureCycleCounter);
+	LOAD(MSP430_EEM_ReadCycleCounterValue);
+	LOAD(MSP430_EEM_ResetCycleCounter);
 	LOAD(MSP430_EnableEnergyTrace);
 	LOAD(MSP430_DisableEnergyTrace);
 	LOAD(MSP430_ResetEnergyTrace);
@@ -130,146 +207,5925 @@ static uint64_t read_le_u56(const uint8_t* p) {
 	     | ((uint64_t)p[6] << 48);
 }
 
-void push_cb(void* pContext, const uint8_t* pBuffer, uint32_t nBufferSize) {
-	if (nBufferSize % ET_RECORD_SIZE != 0) {
-		fprintf(stderr, "Error: Unexpected EnergyTrace record length %u bytes.\n", nBufferSize);
-		return;
+/*
+ * Small portability layer for the worker threads below: pthreads on POSIX,
+ * native threads and condition variables on Windows.
+ */
+#ifdef _WIN32
+typedef HANDLE             thread_t;
+typedef CRITICAL_SECTION   mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+
+#define mutex_init(m)     InitializeCriticalSection(m)
+#define mutex_destroy(m)  DeleteCriticalSection(m)
+#define mutex_lock(m)     EnterCriticalSection(m)
+#define mutex_unlock(m)   LeaveCriticalSection(m)
+#define cond_init(c)      InitializeConditionVariable(c)
+#define cond_destroy(c)   ((void)(c))
+#define cond_wait(c, m)   SleepConditionVariableCS(c, m, INFINITE)
+#define cond_broadcast(c) WakeAllConditionVariable(c)
+
+struct thread_start { void* (*fn)(void*); void* arg; };
+
+static DWORD WINAPI thread_trampoline(LPVOID p) {
+	struct thread_start ts = *(struct thread_start*)p;
+	free(p);
+	ts.fn(ts.arg);
+	return 0;
+}
+
+static int thread_create(thread_t* t, void* (*fn)(void*), void* arg) {
+	struct thread_start* ts = malloc(sizeof(*ts));
+	if (!ts)
+		return -1;
+	ts->fn = fn;
+	ts->arg = arg;
+	*t = CreateThread(NULL, 0, thread_trampoline, ts, 0, NULL);
+	if (!*t) {
+		free(ts);
+		return -1;
 	}
+	return 0;
+}
 
-	uint32_t n = nBufferSize / ET_RECORD_SIZE;
-	for (uint32_t i = 0; i < n; i++) {
-		const uint8_t* ev = pBuffer + (i * ET_RECORD_SIZE);
-		if (ev[0] == ET_EVENT_CURR_VOLT_ENERGY) {
-			uint64_t timestamp = read_le_u56(ev + 1);
-			uint32_t current = read_le_u32(ev + 8);
-			uint32_t voltage = read_le_u16(ev + 12);
-			uint32_t energy = read_le_u32(ev + 14);
-			printf("%020" PRIu64 ",%010" PRIu32 ",%010" PRIu32 ",%010" PRIu32 "\n",
-			       timestamp,
-			       current,
-			       voltage,
-			       energy);
+static void thread_join(thread_t t) {
+	WaitForSingleObject(t, INFINITE);
+	CloseHandle(t);
+}
+
+static uint64_t host_time_us(void) {
+	LARGE_INTEGER f, c;
+	QueryPerformanceFrequency(&f);
+	QueryPerformanceCounter(&c);
+	return (uint64_t)(c.QuadPart / f.QuadPart) * 1000000
+	     + (uint64_t)(c.QuadPart % f.QuadPart) * 1000000 / f.QuadPart;
+}
+
+/* Wall clock time since the Unix epoch, us. */
+static uint64_t host_wall_us(void) {
+	FILETIME ft;
+	GetSystemTimePreciseAsFileTime(&ft);
+	return (((uint64_t)ft.dwHighDateTime << 32 | ft.dwLowDateTime) - 116444736000000000ULL) / 10;
+}
+#else
+typedef pthread_t       thread_t;
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t  cond_t;
+
+#define mutex_init(m)     pthread_mutex_init(m, NULL)
+#define mutex_destroy(m)  pthread_mutex_destroy(m)
+#define mutex_lock(m)     pthread_mutex_lock(m)
+#define mutex_unlock(m)   pthread_mutex_unlock(m)
+#define cond_init(c)      pthread_cond_init(c, NULL)
+#define cond_destroy(c)   pthread_cond_destroy(c)
+#define cond_wait(c, m)   pthread_cond_wait(c, m)
+#define cond_broadcast(c) pthread_cond_broadcast(c)
+
+static int thread_create(thread_t* t, void* (*fn)(void*), void* arg) {
+	return pthread_create(t, NULL, fn, arg) == 0 ? 0 : -1;
+}
+
+static void thread_join(thread_t t) {
+	pthread_join(t, NULL);
+}
+
+static uint64_t host_time_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/* Wall clock time since the Unix epoch, us. */
+static uint64_t host_wall_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+#endif
+
+/*
+ * Output sink.
+ *
+ * Sample rows are formatted into a fixed pool of buffers that is allocated
+ * once when the sink is opened, so the callback thread never allocates.
+ * Full buffers are handed to a writer backend and recycled on completion:
+ *
+ *  - SINK_URING:   Linux io_uring with the pool registered as fixed buffers.
+ *  - SINK_THREADS: worker threads doing blocking writes (pwrite on files).
+ *  - SINK_STDIO:   synchronous fwrite on the calling thread.
+ *
+ * Only regular files (not opened O_APPEND) are written out of order at
+ * explicit offsets; pipes and terminals get one write in flight at a time.
+ */
+enum {
+	SINK_BUFFERS     = 16,
+	SINK_BUFFER_SIZE = 64 * 1024,
+	SINK_MAX_WORKERS = 2,
+	SINK_FLUSH_US    = 200000,  /* max age of a partially filled buffer */
+};
+
+enum sink_kind { SINK_AUTO, SINK_URING, SINK_THREADS, SINK_STDIO };
+
+static const char* const sink_kind_names[] = { "auto", "uring", "threads", "stdio" };
+
+struct sink_job {
+	int      buf;
+	size_t   len;
+	size_t   done;
+	uint64_t off;
+};
+
+#ifdef HAVE_IO_URING
+struct uring {
+	int                  fd;
+	unsigned*            sq_tail;
+	unsigned*            sq_mask;
+	unsigned*            sq_array;
+	unsigned*            cq_head;
+	unsigned*            cq_tail;
+	unsigned*            cq_mask;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	void*                sq_ring;
+	size_t               sq_ring_len;
+	void*                cq_ring;
+	size_t               cq_ring_len;
+	size_t               sqes_len;
+};
+#endif
+
+struct sink {
+	enum sink_kind kind;
+	int            fd;
+	bool           seekable;
+	bool           failed;
+	uint64_t       offset;        /* next write offset when seekable */
+	char*          pool;
+	int            cur;           /* buffer being filled, -1 if none */
+	size_t         fill;
+	uint64_t       cur_since;     /* host time the current buffer got its first byte */
+	int            free_bufs[SINK_BUFFERS];
+	int            nfree;
+	struct sink_job jobs[SINK_BUFFERS];
+	int            inflight;
+
+	/* SINK_THREADS */
+	thread_t       workers[SINK_MAX_WORKERS];
+	int            nworkers;
+	mutex_t        lock;
+	cond_t         cond;
+	int            queue[SINK_BUFFERS];
+	int            qhead, qcount;
+	bool           closing;
+
+#ifdef HAVE_IO_URING
+	struct uring   ring;
+#endif
+};
+
+/* Blocking write of the whole buffer; off == UINT64_MAX writes at the file position. */
+static int write_all(int fd, const char* p, size_t len, uint64_t off) {
+	while (len > 0) {
+#ifdef _WIN32
+		(void)off;
+		int n = _write(fd, p, (unsigned)len);
+#else
+		ssize_t n = (off == UINT64_MAX) ? write(fd, p, len) : pwrite(fd, p, len, (off_t)off);
+#endif
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
 		}
+		p += n;
+		len -= (size_t)n;
+		if (off != UINT64_MAX)
+			off += (uint64_t)n;
 	}
+	return 0;
 }
 
-void error_cb(void* pContext, const char* pszErrorText) {
-	printf("error %s\n", pszErrorText);
+static char* sink_buffer(struct sink* s, int buf) {
+	return s->pool + (size_t)buf * SINK_BUFFER_SIZE;
 }
 
-void usage(char *a0) {
-	printf("usage: %s <seconds> [port]\n", a0);
-	printf("  seconds  Measurement duration\n");
-	printf("  port     Interface port (default: TIUSB)\n");
-	printf("           Examples: TIUSB, USB, COM3, COM4\n");
+static void* sink_worker(void* arg) {
+	struct sink* s = arg;
+	mutex_lock(&s->lock);
+	for (;;) {
+		while (s->qcount == 0 && !s->closing)
+			cond_wait(&s->cond, &s->lock);
+		if (s->qcount == 0)
+			break;
+		int buf = s->queue[s->qhead];
+		s->qhead = (s->qhead + 1) % SINK_BUFFERS;
+		s->qcount--;
+		struct sink_job job = s->jobs[buf];
+		mutex_unlock(&s->lock);
+
+		int rc = write_all(s->fd, sink_buffer(s, buf), job.len, job.off);
+
+		mutex_lock(&s->lock);
+		if (rc != 0)
+			s->failed = true;
+		s->free_bufs[s->nfree++] = buf;
+		s->inflight--;
+		cond_broadcast(&s->cond);
+	}
+	mutex_unlock(&s->lock);
+	return NULL;
 }
 
-int main(int argc, char *argv[]) {
-	if(argc<2) {
-		usage(argv[0]);
-		return 1;
+#ifdef HAVE_IO_URING
+static int uring_setup(struct sink* s) {
+	struct uring* r = &s->ring;
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	r->fd = (int)syscall(__NR_io_uring_setup, SINK_BUFFERS, &p);
+	if (r->fd < 0)
+		return -1;
+	/* Non-seekable outputs rely on writing at the current file position. */
+	if (!s->seekable && !(p.features & IORING_FEAT_RW_CUR_POS))
+		goto fail_fd;
+
+	r->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sq_ring = mmap(NULL, r->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                  r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED)
+		goto fail_fd;
+	r->cq_ring = mmap(NULL, r->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                  r->fd, IORING_OFF_CQ_RING);
+	if (r->cq_ring == MAP_FAILED)
+		goto fail_sq;
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	               r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto fail_cq;
+
+	char* sq = r->sq_ring;
+	char* cq = r->cq_ring;
+	r->sq_tail  = (unsigned*)(sq + p.sq_off.tail);
+	r->sq_mask  = (unsigned*)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned*)(sq + p.sq_off.array);
+	r->cq_head  = (unsigned*)(cq + p.cq_off.head);
+	r->cq_tail  = (unsigned*)(cq + p.cq_off.tail);
+	r->cq_mask  = (unsigned*)(cq + p.cq_off.ring_mask);
+	r->cqes     = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+	struct iovec iov[SINK_BUFFERS];
+	for (int i = 0; i < SINK_BUFFERS; i++) {
+		iov[i].iov_base = sink_buffer(s, i);
+		iov[i].iov_len = SINK_BUFFER_SIZE;
 	}
-	unsigned int duration = strtod(argv[1], 0);
-	if(duration == 0) {
-		usage(argv[0]);
-		return 1;
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, SINK_BUFFERS) < 0)
+		goto fail_sqes;
+	return 0;
+
+fail_sqes:
+	munmap(r->sqes, r->sqes_len);
+fail_cq:
+	munmap(r->cq_ring, r->cq_ring_len);
+fail_sq:
+	munmap(r->sq_ring, r->sq_ring_len);
+fail_fd:
+	close(r->fd);
+	return -1;
+}
+
+static void uring_teardown(struct sink* s) {
+	struct uring* r = &s->ring;
+	munmap(r->sqes, r->sqes_len);
+	munmap(r->cq_ring, r->cq_ring_len);
+	munmap(r->sq_ring, r->sq_ring_len);
+	close(r->fd);
+}
+
+static void uring_queue(struct sink* s, int buf) {
+	struct uring* r = &s->ring;
+	struct sink_job* job = &s->jobs[buf];
+	unsigned tail = *r->sq_tail;
+	unsigned idx = tail & *r->sq_mask;
+	struct io_uring_sqe* sqe = &r->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->fd = s->fd;
+	sqe->addr = (uint64_t)(uintptr_t)(sink_buffer(s, buf) + job->done);
+	sqe->len = (uint32_t)(job->len - job->done);
+	sqe->off = s->seekable ? job->off + job->done : (uint64_t)-1;
+	sqe->buf_index = (uint16_t)buf;
+	sqe->user_data = (uint64_t)buf;
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	long rc;
+	while ((rc = syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0)) < 0 && errno == EINTR)
+		;
+	if (rc < 0) {
+		/* Nothing was consumed: take the entry back and give up on this buffer. */
+		__atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+		s->failed = true;
+		s->free_bufs[s->nfree++] = buf;
+		s->inflight--;
 	}
+}
 
-#ifdef _WIN32
-	if (LoadMSP430() != 0)
-		return 1;
-#endif
+/* Reap completions, waiting for at least one if 'wait' is set. */
+static void uring_reap(struct sink* s, bool wait) {
+	struct uring* r = &s->ring;
+	unsigned head = *r->cq_head;
 
-	STATUS_T status, secure = STATUS_OK;
-	char* portNumber;
-	int  version;
-	long  vcc = 3300;
-	union DEVICE_T device;
+	if (wait && head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		while (syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+		       && errno == EINTR)
+			;
+	}
 
-	portNumber = (argc >= 3) ? argv[2] : "TIUSB";
+	unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+		int buf = (int)cqe->user_data;
+		struct sink_job* job = &s->jobs[buf];
+		bool retry = false;
 
-	printf("#Initializing the interface: ");
-	status = MSP430_Initialize(portNumber, &version);
-	printf("#MSP430_Initialize(portNumber=%s, version=%d) returns %d\n", portNumber, version, status);
-	if(status != STATUS_OK) {
-		fprintf(stderr, "Error: %s\n", MSP430_Error_String(MSP430_Error_Number()));
-		if(version == -1 || version == -3) {
-			fprintf(stderr, "Note: DLL/firmware version mismatch (version=%d).\n"
-			                "Consider updating the MSP Debug Stack or FET firmware.\n", version);
+		if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+			retry = true;
+		} else if (cqe->res <= 0) {
+			/* A zero-length write with bytes left would truncate the output silently. */
+			s->failed = true;
+		} else {
+			job->done += (size_t)cqe->res;
+			retry = job->done < job->len;
+		}
+		__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+
+		if (retry) {
+			uring_queue(s, buf);
+		} else {
+			s->free_bufs[s->nfree++] = buf;
+			s->inflight--;
 		}
-		return 1;
 	}
+}
+#endif /* HAVE_IO_URING */
 
-	//status = MSP430_Configure(ET_CURRENTDRIVE_FINE, 1);
-	//printf("#MSP430_Configure(ET_CURRENTDRIVE_FINE, 1) =%d\n", status);
+static int sink_open(struct sink* s, int fd, enum sink_kind kind) {
+	memset(s, 0, sizeof(*s));
+	s->fd = fd;
+	s->cur = -1;
+	s->pool = malloc((size_t)SINK_BUFFERS * SINK_BUFFER_SIZE);
+	if (!s->pool)
+		return -1;
+	for (int i = 0; i < SINK_BUFFERS; i++)
+		s->free_bufs[s->nfree++] = SINK_BUFFERS - 1 - i;
 
-	// 2. Set the device Vcc.
-	printf("#Setting the device Vcc: ");
-	status = MSP430_VCC(vcc);
-	printf("#MSP430_VCC(%d) returns %d\n", vcc, status);
+#ifndef _WIN32
+	struct stat st;
+	int flags = fcntl(fd, F_GETFL);
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && flags >= 0 && !(flags & O_APPEND)) {
+		off_t pos = lseek(fd, 0, SEEK_CUR);
+		if (pos >= 0) {
+			s->seekable = true;
+			s->offset = (uint64_t)pos;
+		}
+	}
+#endif
+
+#ifdef HAVE_IO_URING
+	if (kind == SINK_AUTO || kind == SINK_URING) {
+		if (uring_setup(s) == 0) {
+			s->kind = SINK_URING;
+			return 0;
+		}
+		if (kind == SINK_URING)
+			fprintf(stderr, "Warning: io_uring unavailable (%s), using writer threads.\n",
+			        strerror(errno));
+		kind = SINK_THREADS;
+	}
+#endif
+	if (kind == SINK_AUTO || kind == SINK_URING)
+		kind = SINK_THREADS;
 
+	if (kind == SINK_THREADS) {
+		mutex_init(&s->lock);
+		cond_init(&s->cond);
+		int n = s->seekable ? SINK_MAX_WORKERS : 1;
+		for (int i = 0; i < n; i++) {
+			if (thread_create(&s->workers[i], sink_worker, s) != 0)
+				break;
+			s->nworkers++;
+		}
+		if (s->nworkers == 0) {
+			cond_destroy(&s->cond);
+			mutex_destroy(&s->lock);
+			kind = SINK_STDIO;
+		}
+	}
+	s->kind = kind;
+	return 0;
+}
 
-	// 3. Open the device.
-#ifdef _WIN32
-	if (MSP430_LoadDeviceDb)
+/* Hand a filled buffer to the backend. */
+static void sink_submit(struct sink* s, int buf, size_t len) {
+	struct sink_job* job = &s->jobs[buf];
+	job->buf = buf;
+	job->len = len;
+	job->done = 0;
+	job->off = s->seekable ? s->offset : UINT64_MAX;
+	s->offset += len;
+
+	switch (s->kind) {
+#ifdef HAVE_IO_URING
+	case SINK_URING:
+		/* Keep writes to pipes and terminals strictly ordered. */
+		while (!s->seekable && s->inflight > 0)
+			uring_reap(s, true);
+		s->inflight++;
+		uring_queue(s, buf);
+		uring_reap(s, false);
+		break;
 #endif
-		MSP430_LoadDeviceDb(NULL); //Required in more recent versions of tilib.
-	printf("#Opening the device: ");
-	status = MSP430_OpenDevice("DEVICE_UNKNOWN", "", 0, 0, DEVICE_UNKNOWN);
-	printf("#MSP430_OpenDevice() returns %d\n", status);
-	if(status != STATUS_OK) {
-		fprintf(stderr, "Error: %s\n", MSP430_Error_String(MSP430_Error_Number()));
-		return 1;
+	case SINK_THREADS:
+		mutex_lock(&s->lock);
+		s->queue[(s->qhead + s->qcount) % SINK_BUFFERS] = buf;
+		s->qcount++;
+		s->inflight++;
+		cond_broadcast(&s->cond);
+		mutex_unlock(&s->lock);
+		break;
+	default:
+		if (fwrite(sink_buffer(s, buf), 1, len, stdout) != len)
+			s->failed = true;
+		s->free_bufs[s->nfree++] = buf;
+		break;
 	}
+}
 
-	// 4. Get device information
-	status = MSP430_GetFoundDevice((char*)&device, sizeof(device.buffer));
-	printf("#MSP430_GetFoundDevice() returns %d\n", status);
-	printf("# device.id: %d\n", device.id);
-	printf("# device.string: %s\n", device.string);
-	printf("# device.mainStart: 0x%04x\n", device.mainStart);
-	printf("# device.infoStart: 0x%04x\n", device.infoStart);
-	printf("# device.ramEnd: 0x%04x\n", device.ramEnd);
-	printf("# device.nBreakpoints: %d\n", device.nBreakpoints);
-	printf("# device.emulation: %d\n", device.emulation);
-	printf("# device.clockControl: %d\n", device.clockControl);
-	printf("# device.lcdStart: 0x%04x\n", device.lcdStart);
-	printf("# device.lcdEnd: 0x%04x\n", device.lcdEnd);
-	printf("# device.vccMinOp: %d\n", device.vccMinOp);
-	printf("# device.vccMaxOp: %d\n", device.vccMaxOp);
-	printf("# device.hasTestVpp: %d\n", device.hasTestVpp);
+static int sink_take_buffer(struct sink* s) {
+	switch (s->kind) {
+#ifdef HAVE_IO_URING
+	case SINK_URING:
+		while (s->nfree == 0)
+			uring_reap(s, true);
+		return s->free_bufs[--s->nfree];
+#endif
+	case SINK_THREADS: {
+		mutex_lock(&s->lock);
+		while (s->nfree == 0)
+			cond_wait(&s->cond, &s->lock);
+		int buf = s->free_bufs[--s->nfree];
+		mutex_unlock(&s->lock);
+		return buf;
+	}
+	default:
+		return s->free_bufs[--s->nfree];
+	}
+}
 
+static void sink_flush(struct sink* s) {
+	if (s->cur >= 0 && s->fill > 0) {
+		sink_submit(s, s->cur, s->fill);
+		s->cur = -1;
+	}
+}
 
-	EnergyTraceSetup ets = {  ET_PROFILING_ANALOG,                // Gives callbacks of with eventID 8
-                      ET_PROFILING_1K,                   // N/A
-                      ET_ALL,                             // N/A
-                      ET_EVENT_WINDOW_100,                // N/A
-                      ET_CALLBACKS_ONLY_DURING_RUN };           // Callbacks are continuously
-	EnergyTraceHandle ha;
-	EnergyTraceCallbacks cbs = {
-		.pContext = 0,
-		.pPushDataFn = push_cb,
-		.pErrorOccurredFn = error_cb
-	};
-	MSP430_Run(FREE_RUN, 1);
-	status = MSP430_EnableEnergyTrace(&ets, &cbs, &ha);
-	printf("#MSP430_EnableEnergyTrace=%d\n", status);
+/* Returns room for at least n (<= SINK_BUFFER_SIZE) bytes; finish with sink_advance(). */
+static char* sink_reserve(struct sink* s, size_t n) {
+	if (s->cur >= 0 && s->fill + n > SINK_BUFFER_SIZE)
+		sink_flush(s);
+	if (s->cur < 0) {
+		s->cur = sink_take_buffer(s);
+		s->fill = 0;
+		s->cur_since = host_time_us();
+	}
+	return sink_buffer(s, s->cur) + s->fill;
+}
 
-	status = MSP430_ResetEnergyTrace(ha);
-	printf("#MSP430_ResetEnergyTrace=%d\n", status);
+static void sink_advance(struct sink* s, size_t n) {
+	s->fill += n;
+}
 
-#ifdef _WIN32
-	Sleep(duration * 1000);
-#else
-	sleep(duration);
+static void sink_vprintf(struct sink* s, const char* fmt, va_list ap) {
+	enum { LINE_MAX_LEN = 1024 };
+	char* p = sink_reserve(s, LINE_MAX_LEN);
+	int n = vsnprintf(p, LINE_MAX_LEN, fmt, ap);
+	if (n > 0)
+		sink_advance(s, n < LINE_MAX_LEN ? (size_t)n : LINE_MAX_LEN - 1);
+}
+
+/* Append a formatted line (e.g. a '#' comment) to the output. */
+static void sink_printf(struct sink* s, const char* fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	sink_vprintf(s, fmt, ap);
+	va_end(ap);
+}
+
+/* Submit the current buffer once it has been sitting around for a while. */
+static void sink_flush_stale(struct sink* s) {
+	if (s->cur >= 0 && host_time_us() - s->cur_since >= SINK_FLUSH_US)
+		sink_flush(s);
+}
+
+/* Flush, wait for all outstanding writes and release the backend. */
+static int sink_close(struct sink* s) {
+	sink_flush(s);
+	switch (s->kind) {
+#ifdef HAVE_IO_URING
+	case SINK_URING:
+		while (s->inflight > 0)
+			uring_reap(s, true);
+		uring_teardown(s);
+		break;
+#endif
+	case SINK_THREADS:
+		mutex_lock(&s->lock);
+		s->closing = true;
+		cond_broadcast(&s->cond);
+		mutex_unlock(&s->lock);
+		for (int i = 0; i < s->nworkers; i++)
+			thread_join(s->workers[i]);
+		cond_destroy(&s->cond);
+		mutex_destroy(&s->lock);
+		break;
+	default:
+		fflush(stdout);
+		break;
+	}
+#ifndef _WIN32
+	/* Offset writes leave the file position alone; move it past our data. */
+	if (s->seekable)
+		lseek(s->fd, (off_t)s->offset, SEEK_SET);
 #endif
+	free(s->pool);
+	s->pool = NULL;
+	return s->failed ? -1 : 0;
+}
 
-	status = MSP430_DisableEnergyTrace(ha);
-	printf("#MSP430_DisableEnergyTrace=%d\n", status);
+/* Write v in decimal, zero-padded to at least 'width' digits. */
+static char* put_u64(char* p, uint64_t v, int width) {
+	int digits = 1;
+	for (uint64_t rest = v / 10; rest > 0; rest /= 10)
+		digits++;
+	if (digits > width)
+		width = digits;
+	for (int i = width - 1; i >= 0; i--) {
+		p[i] = (char)('0' + v % 10);
+		v /= 10;
+	}
+	return p + width;
+}
 
-	printf("#Closing the interface: ");
-	status = MSP430_Close(0);
-	printf("#MSP430_Close(FALSE) returns %d\n", status);
+struct et_sample {
+	uint64_t timestamp;  /* us */
+	uint32_t current;    /* nA */
+	uint32_t voltage;    /* mV */
+	uint32_t energy;
+};
+
+enum {
+	ET_BLOCK_SAMPLES = 256,  /* samples decoded per processing block */
+	ET_ROW_MAX       = 128,  /* upper bound on one formatted output row */
+	ET_ENERGY_NJ     = 100,  /* energy counter resolution: 0.1 uJ per count */
+};
+
+/* Optional columns appended to each output row; NULL members are left out. */
+struct row_extras {
+	const uint32_t* didt;   /* current derived from the energy counter, nA */
+	const uint64_t* host;   /* host clock time, us */
+};
+
+static void write_samples(struct sink* out, const struct et_sample* s, uint32_t n,
+                          const struct row_extras* x) {
+	for (uint32_t i = 0; i < n; i++) {
+		char* row = sink_reserve(out, ET_ROW_MAX);
+		char* p = row;
+		p = put_u64(p, s[i].timestamp, 20);
+		*p++ = ',';
+		p = put_u64(p, s[i].current, 10);
+		*p++ = ',';
+		p = put_u64(p, s[i].voltage, 10);
+		*p++ = ',';
+		p = put_u64(p, s[i].energy, 10);
+		if (x && x->didt) {
+			*p++ = ',';
+			p = put_u64(p, x->didt[i], 10);
+		}
+		if (x && x->host) {
+			*p++ = ',';
+			p = put_u64(p, x->host[i], 20);
+		}
+		*p++ = '\n';
+		sink_advance(out, (size_t)(p - row));
+	}
+}
+
+#ifndef _WIN32
+/*
+ * Broadcast ring for live consumers, in private or POSIX shared memory.
+ *
+ * The capture thread publishes every decoded block into the next slot and
+ * never waits for anyone. Each slot carries a sequence word that is odd
+ * while the slot is being rewritten, so a reader copies a block out and
+ * then checks the word again to tell whether the producer lapped it (an
+ * overrun). Readers attach and detach at will; the producer never knows.
+ */
+enum {
+	BCAST_SLOTS   = 1024,
+	BCAST_VERSION = 1,
+};
+#define BCAST_MAGIC 0x43425445u  /* "ETBC" */
+
+struct bcast_slot {
+	_Atomic uint64_t seq;      /* 2*block+1 while writing, 2*block+2 once valid */
+	uint32_t         count;
+	uint32_t         reserved;
+	struct et_sample samples[ET_BLOCK_SAMPLES];
+};
+
+struct bcast_header {
+	uint32_t          magic;
+	uint32_t          version;
+	uint32_t          slots;
+	uint32_t          slot_samples;
+	_Atomic uint64_t  head;     /* number of blocks published */
+	_Atomic uint32_t  closed;   /* set once the capture has ended */
+	uint32_t          reserved;
+	struct bcast_slot slot[];
+};
+
+struct bcast {
+	struct bcast_header* hdr;
+	size_t               size;
+	char                 name[64];  /* shm object name, empty for a private ring */
+};
+
+struct bcast_reader {
+	uint64_t next;   /* next block to read */
+	uint64_t lost;   /* blocks skipped because of overruns */
+};
+
+static size_t bcast_size(uint32_t slots) {
+	return sizeof(struct bcast_header) + (size_t)slots * sizeof(struct bcast_slot);
+}
+
+static void bcast_set_name(struct bcast* b, const char* name) {
+	snprintf(b->name, sizeof(b->name), "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+/* Create a ring; name == NULL gives a private ring for in-process readers. */
+static int bcast_create(struct bcast* b, const char* name) {
+	memset(b, 0, sizeof(*b));
+	b->size = bcast_size(BCAST_SLOTS);
+	if (name) {
+		bcast_set_name(b, name);
+		int fd = shm_open(b->name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			return -1;
+		if (ftruncate(fd, (off_t)b->size) != 0) {
+			close(fd);
+			shm_unlink(b->name);
+			return -1;
+		}
+		b->hdr = mmap(NULL, b->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+	} else {
+		b->hdr = mmap(NULL, b->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	}
+	if (b->hdr == MAP_FAILED) {
+		if (name)
+			shm_unlink(b->name);
+		b->hdr = NULL;
+		return -1;
+	}
+	b->hdr->version = BCAST_VERSION;
+	b->hdr->slots = BCAST_SLOTS;
+	b->hdr->slot_samples = ET_BLOCK_SAMPLES;
+	atomic_thread_fence(memory_order_release);
+	b->hdr->magic = BCAST_MAGIC;
+	return 0;
+}
+
+static int bcast_attach(struct bcast* b, const char* name) {
+	memset(b, 0, sizeof(*b));
+	bcast_set_name(b, name);
+	int fd = shm_open(b->name, O_RDONLY, 0);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct bcast_header)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	b->size = (size_t)st.st_size;
+	b->hdr = mmap(NULL, b->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (b->hdr == MAP_FAILED) {
+		b->hdr = NULL;
+		return -1;
+	}
+	if (b->hdr->magic != BCAST_MAGIC || b->hdr->version != BCAST_VERSION
+	    || b->hdr->slot_samples != ET_BLOCK_SAMPLES || bcast_size(b->hdr->slots) > b->size) {
+		munmap(b->hdr, b->size);
+		b->hdr = NULL;
+		errno = EPROTO;
+		return -1;
+	}
+	return 0;
+}
+
+static void bcast_publish(struct bcast* b, const struct et_sample* s, uint32_t n) {
+	struct bcast_header* h = b->hdr;
+	uint64_t blk = atomic_load_explicit(&h->head, memory_order_relaxed);
+	struct bcast_slot* slot = &h->slot[blk % h->slots];
+
+	atomic_store_explicit(&slot->seq, 2 * blk + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	slot->count = n;
+	memcpy(slot->samples, s, n * sizeof(*s));
+	atomic_store_explicit(&slot->seq, 2 * blk + 2, memory_order_release);
+	atomic_store_explicit(&h->head, blk + 1, memory_order_release);
+}
+
+/* Producer side: mark the ring finished and drop it. */
+static void bcast_close(struct bcast* b) {
+	atomic_store_explicit(&b->hdr->closed, 1, memory_order_release);
+	munmap(b->hdr, b->size);
+	if (b->name[0])
+		shm_unlink(b->name);
+	b->hdr = NULL;
+}
+
+static void bcast_detach(struct bcast* b) {
+	munmap(b->hdr, b->size);
+	b->hdr = NULL;
+}
+
+static bool bcast_closed(const struct bcast* b) {
+	return atomic_load_explicit(&b->hdr->closed, memory_order_acquire) != 0;
+}
+
+static void bcast_reader_init(const struct bcast* b, struct bcast_reader* r) {
+	r->next = atomic_load_explicit(&b->hdr->head, memory_order_acquire);
+	r->lost = 0;
+}
+
+/*
+ * Copy the reader's next block into out. Returns the sample count, 0 if
+ * nothing new has been published, or -1 after an overrun, in which case the
+ * reader has been moved up to the oldest block that is still intact.
+ */
+static int bcast_read(const struct bcast* b, struct bcast_reader* r, struct et_sample* out) {
+	struct bcast_header* h = b->hdr;
+	uint64_t head = atomic_load_explicit(&h->head, memory_order_acquire);
+	if (r->next >= head)
+		return 0;
+
+	/* The slot after head may be mid-rewrite, so only slots-1 blocks are safe. */
+	uint64_t oldest = head >= h->slots ? head - h->slots + 1 : 0;
+	if (r->next >= oldest) {
+		struct bcast_slot* slot = &h->slot[r->next % h->slots];
+		uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		uint32_t n = slot->count;
+		if (seq == 2 * r->next + 2 && n <= ET_BLOCK_SAMPLES) {
+			memcpy(out, slot->samples, n * sizeof(*out));
+			atomic_thread_fence(memory_order_acquire);
+			if (atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq) {
+				r->next++;
+				return (int)n;
+			}
+		}
+		head = atomic_load_explicit(&h->head, memory_order_acquire);
+		oldest = head >= h->slots ? head - h->slots + 1 : 0;
+	}
+	if (oldest <= r->next)
+		oldest = r->next + 1;
+	r->lost += oldest - r->next;
+	r->next = oldest;
+	return -1;
+}
+
+/* energytrace shm-read NAME: print the samples published by a running capture. */
+static int shm_read_main(int argc, char* argv[]) {
+	if (argc < 2) {
+		printf("usage: energytrace shm-read <name>\n");
+		return 1;
+	}
+
+	struct bcast b;
+	if (bcast_attach(&b, argv[1]) != 0) {
+		fprintf(stderr, "Error: Could not attach to shared memory %s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+
+	struct sink out;
+	if (sink_open(&out, fileno(stdout), SINK_AUTO) != 0) {
+		fprintf(stderr, "Error: Could not allocate output buffers.\n");
+		bcast_detach(&b);
+		return 1;
+	}
+
+	struct bcast_reader r;
+	struct et_sample block[ET_BLOCK_SAMPLES];
+	bcast_reader_init(&b, &r);
+	for (;;) {
+		int n = bcast_read(&b, &r, block);
+		if (n > 0) {
+			write_samples(&out, block, (uint32_t)n, NULL);
+		} else if (n < 0) {
+			sink_printf(&out, "#overrun: %" PRIu64 " blocks lost so far\n", r.lost);
+		} else if (bcast_closed(&b)) {
+			break;
+		} else {
+			sink_flush_stale(&out);
+			usleep(1000);
+		}
+	}
+
+	int rc = sink_close(&out);
+	printf("#Blocks lost to overruns: %" PRIu64 "\n", r.lost);
+	bcast_detach(&b);
+	return rc == 0 ? 0 : 1;
+}
+#endif /* !_WIN32 */
+
+#ifndef _WIN32
+/*
+ * Live sample server on a Unix domain socket.
+ *
+ * A client connects and sends one request line, e.g. "columns=ti decimate=10",
+ * and then receives a stream of binary frames: a struct server_frame header
+ * followed by 'count' rows holding the selected columns (t: u64 timestamp,
+ * i: u32 current, v: u32 voltage, e: u32 energy), in that order, in host
+ * byte order. The server thread follows the broadcast ring on its own, so a
+ * slow client only ever falls behind in the ring: each overrun doubles its
+ * decimation, and a client that overruns at the maximum decimation is
+ * disconnected. The capture callback is never held up.
+ */
+enum {
+	SERVER_MAX_CLIENTS  = 16,
+	SERVER_OUT_SIZE     = 64 * 1024,
+	SERVER_REQUEST_MAX  = 128,
+	SERVER_DECIMATE_MAX = 1024,
+	SERVER_POLL_MS      = 10,
+};
+#define SERVER_FRAME_MAGIC 0x46535445u  /* "ETSF" */
+
+enum {
+	COL_TIME    = 1 << 0,
+	COL_CURRENT = 1 << 1,
+	COL_VOLTAGE = 1 << 2,
+	COL_ENERGY  = 1 << 3,
+	COL_ALL     = 0xf,
+};
+
+struct server_frame {
+	uint32_t magic;
+	uint32_t columns;    /* COL_* mask */
+	uint64_t block;      /* ring block number, gaps mean dropped blocks */
+	uint32_t decimate;
+	uint32_t count;      /* rows following */
+};
+
+struct server_client {
+	int                 fd;
+	int                 id;
+	bool                subscribed;
+	char                request[SERVER_REQUEST_MAX];
+	size_t              request_len;
+	uint32_t            columns;
+	uint32_t            decimate;
+	uint32_t            phase;      /* samples until the next one is kept */
+	struct bcast_reader reader;
+	char*               out;
+	size_t              out_len, out_pos;
+
+	/* queue metrics */
+	uint64_t            frames;
+	uint64_t            samples;
+	uint64_t            bytes;
+	uint64_t            max_lag;    /* deepest backlog in ring blocks */
+};
+
+struct server {
+	const char*          path;
+	int                  listen_fd;
+	struct bcast*        ring;
+	thread_t             thread;
+	atomic_bool          stop;
+	int                  next_id;
+	struct server_client clients[SERVER_MAX_CLIENTS];
+	int                  nclients;
+	uint64_t             dropped_clients;
+};
+
+static size_t server_row_size(uint32_t columns) {
+	return ((columns & COL_TIME) ? 8 : 0) + ((columns & COL_CURRENT) ? 4 : 0)
+	     + ((columns & COL_VOLTAGE) ? 4 : 0) + ((columns & COL_ENERGY) ? 4 : 0);
+}
+
+static void server_report(const struct server_client* c, const char* why) {
+	fprintf(stderr, "#server: client %d %s: %" PRIu64 " frames, %" PRIu64 " samples, %" PRIu64
+	        " bytes, %" PRIu64 " blocks dropped, max lag %" PRIu64 " blocks, decimate %u\n",
+	        c->id, why, c->frames, c->samples, c->bytes, c->reader.lost, c->max_lag, c->decimate);
+}
+
+static void server_drop(struct server* srv, int idx, const char* why) {
+	struct server_client* c = &srv->clients[idx];
+	server_report(c, why);
+	close(c->fd);
+	free(c->out);
+	srv->clients[idx] = srv->clients[--srv->nclients];
+}
+
+/* Parse "columns=tive decimate=N"; unknown keys are ignored. */
+static void server_parse_request(struct server_client* c) {
+	char* save = NULL;
+	c->columns = COL_ALL;
+	c->decimate = 1;
+	for (char* tok = strtok_r(c->request, " \t\r\n", &save); tok; tok = strtok_r(NULL, " \t\r\n", &save)) {
+		if (strncmp(tok, "columns=", 8) == 0) {
+			c->columns = 0;
+			for (const char* p = tok + 8; *p; p++) {
+				const char* col = strchr("tive", *p);
+				if (col)
+					c->columns |= 1u << (col - "tive");
+			}
+			if (c->columns == 0)
+				c->columns = COL_ALL;
+		} else if (strncmp(tok, "decimate=", 9) == 0) {
+			unsigned long d = strtoul(tok + 9, NULL, 10);
+			c->decimate = d < 1 ? 1 : d > SERVER_DECIMATE_MAX ? SERVER_DECIMATE_MAX : (uint32_t)d;
+		}
+	}
+	c->subscribed = true;
+}
+
+/*
+ * Encode one ring block as a frame into the client's output buffer. Rows
+ * can leave the buffer 4-byte aligned, so the header is copied into place.
+ */
+static void server_encode(struct server_client* c, uint64_t block, const struct et_sample* s, int n) {
+	char* start = c->out + c->out_len;
+	char* p = start + sizeof(struct server_frame);
+	uint32_t count = 0;
+
+	for (int i = 0; i < n; i++) {
+		if (c->phase > 0) {
+			c->phase--;
+			continue;
+		}
+		c->phase = c->decimate - 1;
+		if (c->columns & COL_TIME)    { memcpy(p, &s[i].timestamp, 8); p += 8; }
+		if (c->columns & COL_CURRENT) { memcpy(p, &s[i].current, 4);   p += 4; }
+		if (c->columns & COL_VOLTAGE) { memcpy(p, &s[i].voltage, 4);   p += 4; }
+		if (c->columns & COL_ENERGY)  { memcpy(p, &s[i].energy, 4);    p += 4; }
+		count++;
+	}
+	if (count == 0)
+		return;
+	struct server_frame f = {
+		.magic = SERVER_FRAME_MAGIC,
+		.columns = c->columns,
+		.block = block,
+		.decimate = c->decimate,
+		.count = count,
+	};
+	memcpy(start, &f, sizeof(f));
+	c->out_len = (size_t)(p - c->out);
+	c->frames++;
+	c->samples += count;
+}
+
+/* Move ring blocks into the client's buffer; returns false if the client must go. */
+static bool server_fill(struct server* srv, struct server_client* c) {
+	size_t frame_max = sizeof(struct server_frame) + ET_BLOCK_SAMPLES * server_row_size(c->columns);
+	struct et_sample block[ET_BLOCK_SAMPLES];
+
+	uint64_t head = atomic_load_explicit(&srv->ring->hdr->head, memory_order_acquire);
+	if (head - c->reader.next > c->max_lag)
+		c->max_lag = head - c->reader.next;
+
+	if (c->out_pos == c->out_len)
+		c->out_pos = c->out_len = 0;
+	while (c->out_len + frame_max <= SERVER_OUT_SIZE) {
+		uint64_t blk = c->reader.next;
+		int n = bcast_read(srv->ring, &c->reader, block);
+		if (n == 0)
+			break;
+		if (n < 0) {
+			if (c->decimate >= SERVER_DECIMATE_MAX)
+				return false;
+			c->decimate *= 2;
+			continue;
+		}
+		server_encode(c, blk, block, n);
+	}
+	return true;
+}
+
+static bool server_send(struct server_client* c) {
+	while (c->out_pos < c->out_len) {
+		ssize_t n = send(c->fd, c->out + c->out_pos, c->out_len - c->out_pos, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		c->out_pos += (size_t)n;
+		c->bytes += (uint64_t)n;
+	}
+	return true;
+}
+
+static void server_accept(struct server* srv) {
+	int fd = accept(srv->listen_fd, NULL, NULL);
+	if (fd < 0)
+		return;
+	if (srv->nclients == SERVER_MAX_CLIENTS) {
+		close(fd);
+		return;
+	}
+	struct server_client* c = &srv->clients[srv->nclients];
+	memset(c, 0, sizeof(*c));
+	c->out = malloc(SERVER_OUT_SIZE);
+	if (!c->out) {
+		close(fd);
+		return;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	c->fd = fd;
+	c->id = ++srv->next_id;
+	c->decimate = 1;
+	srv->nclients++;
+}
+
+static void* server_thread(void* arg) {
+	struct server* srv = arg;
+	struct pollfd pfd[SERVER_MAX_CLIENTS + 1];
+
+	while (!atomic_load_explicit(&srv->stop, memory_order_acquire)) {
+		pfd[0].fd = srv->listen_fd;
+		pfd[0].events = POLLIN;
+		for (int i = 0; i < srv->nclients; i++) {
+			struct server_client* c = &srv->clients[i];
+			pfd[i + 1].fd = c->fd;
+			pfd[i + 1].events = POLLIN | (c->out_pos < c->out_len ? POLLOUT : 0);
+			pfd[i + 1].revents = 0;
+		}
+		int nfds = srv->nclients + 1;
+		poll(pfd, (nfds_t)nfds, SERVER_POLL_MS);
+
+		/* Walk backwards so server_drop() can move the last client into the hole. */
+		for (int i = nfds - 2; i >= 0; i--) {
+			struct server_client* c = &srv->clients[i];
+			if (pfd[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) {
+				char buf[SERVER_REQUEST_MAX];
+				ssize_t n = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT);
+				if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+					server_drop(srv, i, "disconnected");
+					continue;
+				}
+				for (ssize_t k = 0; k < n && !c->subscribed; k++) {
+					if (buf[k] == '\n' || c->request_len == SERVER_REQUEST_MAX - 1) {
+						c->request[c->request_len] = '\0';
+						server_parse_request(c);
+						bcast_reader_init(srv->ring, &c->reader);
+					} else {
+						c->request[c->request_len++] = buf[k];
+					}
+				}
+			}
+			if (!c->subscribed)
+				continue;
+			if (!server_fill(srv, c)) {
+				srv->dropped_clients++;
+				server_drop(srv, i, "dropped (too slow)");
+				continue;
+			}
+			if (!server_send(c))
+				server_drop(srv, i, "disconnected");
+		}
+		if (pfd[0].revents & POLLIN)
+			server_accept(srv);
+	}
+
+	/* Hand out what the capture produced before shutting down (bounded wait). */
+	uint64_t deadline = host_time_us() + 1000000;
+	for (int i = srv->nclients - 1; i >= 0; i--) {
+		struct server_client* c = &srv->clients[i];
+		while (c->subscribed && server_fill(srv, c) && server_send(c)
+		       && c->out_pos < c->out_len && host_time_us() < deadline) {
+			struct pollfd p = { .fd = c->fd, .events = POLLOUT };
+			poll(&p, 1, SERVER_POLL_MS);
+		}
+		server_drop(srv, i, "closed");
+	}
+	return NULL;
+}
+
+static int server_start(struct server* srv, const char* path, struct bcast* ring) {
+	struct sockaddr_un addr;
+	memset(srv, 0, sizeof(*srv));
+	atomic_init(&srv->stop, false);
+	memset(&addr, 0, sizeof(addr));
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	srv->path = path;
+	srv->ring = ring;
+	srv->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (srv->listen_fd < 0)
+		return -1;
+	unlink(path);
+	if (bind(srv->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+	    || listen(srv->listen_fd, SERVER_MAX_CLIENTS) != 0) {
+		close(srv->listen_fd);
+		return -1;
+	}
+	fcntl(srv->listen_fd, F_SETFL, fcntl(srv->listen_fd, F_GETFL) | O_NONBLOCK);
+	if (thread_create(&srv->thread, server_thread, srv) != 0) {
+		close(srv->listen_fd);
+		unlink(path);
+		return -1;
+	}
+	return 0;
+}
+
+static void server_stop(struct server* srv) {
+	atomic_store_explicit(&srv->stop, true, memory_order_release);
+	thread_join(srv->thread);
+	close(srv->listen_fd);
+	unlink(srv->path);
+}
+#endif /* !_WIN32 */
+
+/*
+ * Downsampling pyramid for zoomable plots.
+ *
+ * While capturing, samples are folded into buckets of 10, 100, ... 10^6
+ * samples, and level k is appended to the file <prefix>.<k> as fixed-size
+ * struct pyramid_bucket records in time order. A viewer can then show any
+ * time range at any width by seeking into the one level that gives about
+ * a screen's worth of buckets (see "energytrace pyramid-view").
+ */
+enum {
+	PYRAMID_LEVELS = 6,
+	PYRAMID_FANOUT = 10,
+	PYRAMID_IOBUF  = 64 * 1024,
+};
+
+struct pyramid_bucket {
+	uint64_t t_start;       /* timestamp of the first sample, us */
+	uint64_t t_end;         /* timestamp of the last sample, us */
+	uint32_t count;         /* samples covered */
+	uint32_t min_current;   /* nA */
+	uint32_t max_current;   /* nA */
+	uint32_t mean_current;  /* nA */
+	uint32_t energy;        /* energy counter increase over the bucket */
+	uint32_t reserved;
+};
+
+struct pyramid_level {
+	FILE*    f;
+	char*    iobuf;
+	uint32_t children;      /* inputs folded into the open bucket */
+	uint64_t current_sum;   /* sum of current over the covered samples */
+	struct pyramid_bucket b;
+};
+
+struct pyramid {
+	struct pyramid_level level[PYRAMID_LEVELS];
+	bool     have_energy;
+	uint32_t last_energy;
+	uint64_t buckets;       /* level 1 buckets written */
+};
+
+static int pyramid_open(struct pyramid* p, const char* prefix) {
+	memset(p, 0, sizeof(*p));
+	for (int k = 0; k < PYRAMID_LEVELS; k++) {
+		char path[1024];
+		snprintf(path, sizeof(path), "%s.%d", prefix, k + 1);
+		struct pyramid_level* l = &p->level[k];
+		l->f = fopen(path, "wb");
+		l->iobuf = malloc(PYRAMID_IOBUF);
+		if (!l->f || !l->iobuf) {
+			fprintf(stderr, "Error: Could not create %s: %s\n", path, strerror(errno));
+			return -1;
+		}
+		setvbuf(l->f, l->iobuf, _IOFBF, PYRAMID_IOBUF);
+	}
+	return 0;
+}
+
+/* Fold a finished bucket of level k into level k+1 (or the file). */
+static void pyramid_emit(struct pyramid* p, int k, uint64_t current_sum) {
+	struct pyramid_level* l = &p->level[k];
+	l->b.mean_current = (uint32_t)(current_sum / l->b.count);
+	fwrite(&l->b, sizeof(l->b), 1, l->f);
+
+	if (k + 1 < PYRAMID_LEVELS) {
+		struct pyramid_level* up = &p->level[k + 1];
+		if (up->children == 0) {
+			up->b = l->b;
+			up->current_sum = current_sum;
+		} else {
+			up->b.t_end = l->b.t_end;
+			up->b.count += l->b.count;
+			up->b.energy += l->b.energy;
+			if (l->b.min_current < up->b.min_current)
+				up->b.min_current = l->b.min_current;
+			if (l->b.max_current > up->b.max_current)
+				up->b.max_current = l->b.max_current;
+			up->current_sum += current_sum;
+		}
+		if (++up->children == PYRAMID_FANOUT) {
+			pyramid_emit(p, k + 1, up->current_sum);
+			up->children = 0;
+		}
+	}
+}
+
+static void pyramid_add(struct pyramid* p, const struct et_sample* s, uint32_t n) {
+	struct pyramid_level* l = &p->level[0];
+	for (uint32_t i = 0; i < n; i++) {
+		uint32_t de = p->have_energy ? s[i].energy - p->last_energy : 0;
+		p->last_energy = s[i].energy;
+		p->have_energy = true;
+
+		if (l->children == 0) {
+			l->b.t_start = s[i].timestamp;
+			l->b.count = 0;
+			l->b.energy = 0;
+			l->b.min_current = UINT32_MAX;
+			l->b.max_current = 0;
+			l->current_sum = 0;
+		}
+		l->b.t_end = s[i].timestamp;
+		l->b.count++;
+		l->b.energy += de;
+		l->current_sum += s[i].current;
+		if (s[i].current < l->b.min_current)
+			l->b.min_current = s[i].current;
+		if (s[i].current > l->b.max_current)
+			l->b.max_current = s[i].current;
+
+		if (++l->children == PYRAMID_FANOUT) {
+			pyramid_emit(p, 0, l->current_sum);
+			l->children = 0;
+			p->buckets++;
+		}
+	}
+}
+
+/* Write out partially filled buckets and close the files. */
+static int pyramid_close(struct pyramid* p) {
+	int rc = 0;
+	for (int k = 0; k < PYRAMID_LEVELS; k++) {
+		struct pyramid_level* l = &p->level[k];
+		if (l->children > 0 && l->f) {
+			l->children = 0;
+			pyramid_emit(p, k, l->current_sum);
+		}
+	}
+	for (int k = 0; k < PYRAMID_LEVELS; k++) {
+		struct pyramid_level* l = &p->level[k];
+		if (l->f && (ferror(l->f) || fclose(l->f) != 0))
+			rc = -1;
+		free(l->iobuf);
+	}
+	return rc;
+}
+
+#ifdef _WIN32
+#define fseek64 _fseeki64
+#define ftell64 _ftelli64
+#else
+#define fseek64 fseeko
+#define ftell64 ftello
+#endif
+
+static int64_t pyramid_level_buckets(FILE* f) {
+	if (fseek64(f, 0, SEEK_END) != 0)
+		return -1;
+	return (int64_t)ftell64(f) / (int64_t)sizeof(struct pyramid_bucket);
+}
+
+static int pyramid_read(FILE* f, int64_t idx, struct pyramid_bucket* b) {
+	if (fseek64(f, idx * (int64_t)sizeof(*b), SEEK_SET) != 0)
+		return -1;
+	return fread(b, sizeof(*b), 1, f) == 1 ? 0 : -1;
+}
+
+/* Index of the first bucket ending at or after t. */
+static int64_t pyramid_find(FILE* f, int64_t nbuckets, uint64_t t) {
+	int64_t lo = 0, hi = nbuckets;
+	struct pyramid_bucket b;
+	while (lo < hi) {
+		int64_t mid = lo + (hi - lo) / 2;
+		if (pyramid_read(f, mid, &b) != 0)
+			return -1;
+		if (b.t_end < t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* energytrace pyramid-view PREFIX [WIDTH [T0 T1]] */
+static int pyramid_view_main(int argc, char* argv[]) {
+	if (argc < 2) {
+		printf("usage: energytrace pyramid-view <prefix> [width [t0_us t1_us]]\n");
+		return 1;
+	}
+	const char* prefix = argv[1];
+	int64_t width = (argc >= 3) ? strtoll(argv[2], NULL, 10) : 1000;
+	if (width < 1)
+		width = 1;
+
+	FILE* lf[PYRAMID_LEVELS];
+	int64_t nb[PYRAMID_LEVELS];
+	for (int k = 0; k < PYRAMID_LEVELS; k++) {
+		char path[1024];
+		snprintf(path, sizeof(path), "%s.%d", prefix, k + 1);
+		lf[k] = fopen(path, "rb");
+		nb[k] = lf[k] ? pyramid_level_buckets(lf[k]) : 0;
+		if (nb[k] < 0)
+			nb[k] = 0;
+	}
+	if (nb[0] == 0) {
+		fprintf(stderr, "Error: No pyramid data at %s.1\n", prefix);
+		return 1;
+	}
+
+	struct pyramid_bucket first, last;
+	pyramid_read(lf[0], 0, &first);
+	pyramid_read(lf[0], nb[0] - 1, &last);
+	uint64_t t0 = first.t_start, t1 = last.t_end;
+	if (argc >= 5) {
+		t0 = strtoull(argv[3], NULL, 10);
+		t1 = strtoull(argv[4], NULL, 10);
+	}
+
+	/* Coarsest level that still has at least 'width' buckets in range. */
+	int level = 0;
+	int64_t from = 0, to = 0;
+	for (int k = PYRAMID_LEVELS - 1; k >= 0; k--) {
+		if (nb[k] == 0)
+			continue;
+		from = pyramid_find(lf[k], nb[k], t0);
+		to = pyramid_find(lf[k], nb[k], t1);
+		if (to < nb[k])
+			to++;
+		level = k;
+		if (to - from >= width)
+			break;
+	}
+
+	long per_bucket = PYRAMID_FANOUT;
+	for (int k = 0; k < level; k++)
+		per_bucket *= PYRAMID_FANOUT;
+	printf("#level %d (%ld samples/bucket), buckets %" PRId64 "..%" PRId64 "\n",
+	       level + 1, per_bucket, from, to);
+	printf("#t_start,t_end,min_current,max_current,mean_current,energy\n");
+	struct pyramid_bucket b;
+	if (from < to && pyramid_read(lf[level], from, &b) == 0) {
+		for (int64_t i = from; i < to; i++) {
+			if (i > from && fread(&b, sizeof(b), 1, lf[level]) != 1)
+				break;
+			printf("%" PRIu64 ",%" PRIu64 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 "\n",
+			       b.t_start, b.t_end, b.min_current, b.max_current, b.mean_current, b.energy);
+		}
+	}
+	for (int k = 0; k < PYRAMID_LEVELS; k++)
+		if (lf[k])
+			fclose(lf[k]);
+	return 0;
+}
+
+/*
+ * Current derived from the energy counter.
+ *
+ * The energy counter is integrated in the probe and is less noisy than the
+ * sampled current, but it only moves in ET_ENERGY_NJ steps, so dE/dt has
+ * to be low-pass filtered before it is useful. Energy and time increments
+ * are run through the same filter and divided, which keeps the filter gain
+ * out of the result and copes with uneven sample spacing:
+ *
+ *   I = filtered(dE) / (filtered(dt) * V)
+ *
+ * The FIR is a Hann-weighted window over the last 'taps' increments; the
+ * IIR is a single pole with coefficient 'alpha'. Both work in place on
+ * fixed-size arrays, and the FIR loops run across the whole block per tap
+ * so the compiler can vectorize them.
+ */
+enum {
+	DIDT_MAX_TAPS     = 1024,
+	DIDT_DEFAULT_TAPS = 16,
+};
+
+enum didt_kind { DIDT_FIR, DIDT_IIR };
+
+struct didt {
+	enum didt_kind   kind;
+	int              taps;
+	float            alpha;
+	float            h[DIDT_MAX_TAPS];
+	/* the last taps-1 increments, followed by the current block */
+	float            de[DIDT_MAX_TAPS - 1 + ET_BLOCK_SAMPLES];
+	float            dt[DIDT_MAX_TAPS - 1 + ET_BLOCK_SAMPLES];
+	float            ye, yt;      /* IIR state */
+	bool             have_prev;
+	struct et_sample prev;
+	uint32_t         out[ET_BLOCK_SAMPLES];
+};
+
+/* Parse "fir:N" or "iir:ALPHA" (empty selects the default FIR). */
+static int didt_init(struct didt* d, const char* spec) {
+	memset(d, 0, sizeof(*d));
+	d->kind = DIDT_FIR;
+	d->taps = DIDT_DEFAULT_TAPS;
+	if (strncmp(spec, "fir:", 4) == 0) {
+		d->taps = atoi(spec + 4);
+		if (d->taps < 1 || d->taps > DIDT_MAX_TAPS)
+			return -1;
+	} else if (strncmp(spec, "iir:", 4) == 0) {
+		d->kind = DIDT_IIR;
+		d->alpha = (float)atof(spec + 4);
+		if (!(d->alpha > 0.0f && d->alpha <= 1.0f))
+			return -1;
+	} else if (*spec) {
+		return -1;
+	}
+
+	if (d->kind == DIDT_FIR) {
+		const double pi = 3.14159265358979323846;
+		for (int k = 0; k < d->taps; k++)
+			d->h[k] = (float)(0.5 - 0.5 * cos(2.0 * pi * (k + 1) / (d->taps + 1)));
+	}
+	return 0;
+}
+
+static void didt_run(struct didt* d, const struct et_sample* s, uint32_t n) {
+	int hist = d->taps - 1;
+	float* xe = d->de + hist;
+	float* xt = d->dt + hist;
+
+	for (uint32_t i = 0; i < n; i++) {
+		uint32_t de = s[i].energy - d->prev.energy;
+		/* A counter that went backwards was reset; don't turn that into a spike. */
+		if (!d->have_prev || de > UINT32_MAX / 2)
+			de = 0;
+		xe[i] = (float)de;
+		xt[i] = d->have_prev ? (float)(s[i].timestamp - d->prev.timestamp) : 0.0f;
+		d->prev = s[i];
+		d->have_prev = true;
+	}
+
+	float fe[ET_BLOCK_SAMPLES], ft[ET_BLOCK_SAMPLES];
+	if (d->kind == DIDT_FIR) {
+		for (uint32_t i = 0; i < n; i++)
+			fe[i] = ft[i] = 0.0f;
+		for (int k = 0; k < d->taps; k++) {
+			const float  h = d->h[k];
+			const float* pe = d->de + k;
+			const float* pt = d->dt + k;
+			for (uint32_t i = 0; i < n; i++) {
+				fe[i] += h * pe[i];
+				ft[i] += h * pt[i];
+			}
+		}
+		memmove(d->de, d->de + n, (size_t)hist * sizeof(float));
+		memmove(d->dt, d->dt + n, (size_t)hist * sizeof(float));
+	} else {
+		for (uint32_t i = 0; i < n; i++) {
+			d->ye += d->alpha * (xe[i] - d->ye);
+			d->yt += d->alpha * (xt[i] - d->yt);
+			fe[i] = d->ye;
+			ft[i] = d->yt;
+		}
+	}
+
+	for (uint32_t i = 0; i < n; i++) {
+		/* nJ per us is mW; divided by mV that is A, times 1e9 for nA */
+		double den = (double)ft[i] * s[i].voltage;
+		double na = den > 0.0 ? fe[i] * ET_ENERGY_NJ * 1e9 / den : 0.0;
+		d->out[i] = na < 4294967295.0 ? (uint32_t)na : UINT32_MAX;
+	}
+}
+
+/*
+ * t-digest (merging variant) for streaming quantiles in fixed memory.
+ * Points are buffered and periodically merged into at most a few hundred
+ * centroids whose size is bounded by the arcsine scale function, which
+ * keeps the tails (p1, p99.9) accurate.
+ */
+enum {
+	TDIGEST_COMPRESSION = 100,
+	TDIGEST_CENTROIDS   = 2 * TDIGEST_COMPRESSION,
+	TDIGEST_BUFFER      = 512,
+};
+
+struct centroid {
+	double mean;
+	double weight;
+};
+
+struct tdigest {
+	struct centroid c[TDIGEST_CENTROIDS + TDIGEST_BUFFER];
+	int             n;       /* merged centroids, followed by nbuf raw points */
+	int             nbuf;
+	double          total;   /* weight of the merged centroids */
+	double          min, max;
+};
+
+static int centroid_cmp(const void* a, const void* b) {
+	double x = ((const struct centroid*)a)->mean, y = ((const struct centroid*)b)->mean;
+	return (x > y) - (x < y);
+}
+
+static void tdigest_init(struct tdigest* t) {
+	t->n = t->nbuf = 0;
+	t->total = 0.0;
+	t->min = INFINITY;
+	t->max = -INFINITY;
+}
+
+static double tdigest_k(double q) {
+	const double pi = 3.14159265358979323846;
+	return TDIGEST_COMPRESSION / (2.0 * pi) * asin(2.0 * q - 1.0);
+}
+
+static double tdigest_q(double k) {
+	const double pi = 3.14159265358979323846;
+	if (k >= TDIGEST_COMPRESSION / 4.0)
+		return 1.0;
+	return (sin(k * 2.0 * pi / TDIGEST_COMPRESSION) + 1.0) / 2.0;
+}
+
+static void tdigest_merge(struct tdigest* t) {
+	if (t->nbuf == 0)
+		return;
+	int m = t->n + t->nbuf;
+	double total = t->total + t->nbuf;
+	qsort(t->c, (size_t)m, sizeof(t->c[0]), centroid_cmp);
+
+	int out = 0;
+	double q0 = 0.0;
+	double qlimit = tdigest_q(tdigest_k(q0) + 1.0);
+	struct centroid cur = t->c[0];
+	for (int i = 1; i < m; i++) {
+		double q = q0 + (cur.weight + t->c[i].weight) / total;
+		if (q <= qlimit) {
+			cur.weight += t->c[i].weight;
+			cur.mean += (t->c[i].mean - cur.mean) * t->c[i].weight / cur.weight;
+		} else {
+			q0 += cur.weight / total;
+			qlimit = tdigest_q(tdigest_k(q0) + 1.0);
+			t->c[out++] = cur;
+			cur = t->c[i];
+		}
+	}
+	t->c[out++] = cur;
+	t->n = out;
+	t->nbuf = 0;
+	t->total = total;
+}
+
+static void tdigest_add(struct tdigest* t, double x) {
+	if (t->nbuf == TDIGEST_BUFFER)
+		tdigest_merge(t);
+	t->c[t->n + t->nbuf].mean = x;
+	t->c[t->n + t->nbuf].weight = 1.0;
+	t->nbuf++;
+	if (x < t->min)
+		t->min = x;
+	if (x > t->max)
+		t->max = x;
+}
+
+static double tdigest_quantile(struct tdigest* t, double q) {
+	tdigest_merge(t);
+	if (t->n == 0)
+		return NAN;
+	double target = q * t->total;
+	double cum = 0.0;  /* weight before centroid i */
+	double prev_center = 0.0, prev_mean = t->min;
+	for (int i = 0; i < t->n; i++) {
+		double center = cum + t->c[i].weight / 2.0;
+		if (target < center) {
+			double span = center - prev_center;
+			double f = span > 0.0 ? (target - prev_center) / span : 0.0;
+			return prev_mean + f * (t->c[i].mean - prev_mean);
+		}
+		prev_center = center;
+		prev_mean = t->c[i].mean;
+		cum += t->c[i].weight;
+	}
+	double span = t->total - prev_center;
+	double f = span > 0.0 ? (target - prev_center) / span : 1.0;
+	return prev_mean + f * (t->max - prev_mean);
+}
+
+/*
+ * Running summary of a capture in O(1) memory: Welford mean/variance and
+ * range of the current, voltage range, duration, energy and a t-digest of
+ * the current for quantiles.
+ */
+struct summary {
+	uint64_t       count;
+	uint64_t       t_first, t_last;
+	double         mean, m2;         /* current, nA */
+	uint32_t       i_min, i_max;
+	uint32_t       v_min, v_max;
+	uint64_t       energy;           /* energy counter increments */
+	uint32_t       prev_energy;
+	struct tdigest digest;
+};
+
+static void summary_reset(struct summary* s) {
+	s->count = 0;
+	s->mean = s->m2 = 0.0;
+	s->i_min = s->v_min = UINT32_MAX;
+	s->i_max = s->v_max = 0;
+	s->energy = 0;
+	tdigest_init(&s->digest);
+}
+
+static void summary_add(struct summary* s, const struct et_sample* x, uint32_t n) {
+	for (uint32_t i = 0; i < n; i++) {
+		if (s->count == 0) {
+			s->t_first = x[i].timestamp;
+		} else {
+			uint32_t de = x[i].energy - s->prev_energy;
+			if (de <= UINT32_MAX / 2)  /* ignore counter resets */
+				s->energy += de;
+		}
+		s->prev_energy = x[i].energy;
+		s->t_last = x[i].timestamp;
+		s->count++;
+
+		double d = x[i].current - s->mean;
+		s->mean += d / (double)s->count;
+		s->m2 += d * (x[i].current - s->mean);
+		if (x[i].current < s->i_min)
+			s->i_min = x[i].current;
+		if (x[i].current > s->i_max)
+			s->i_max = x[i].current;
+		if (x[i].voltage < s->v_min)
+			s->v_min = x[i].voltage;
+		if (x[i].voltage > s->v_max)
+			s->v_max = x[i].voltage;
+		tdigest_add(&s->digest, x[i].current);
+	}
+}
+
+static double summary_seconds(const struct summary* s) {
+	return s->count > 1 ? (s->t_last - s->t_first) / 1e6 : 0.0;
+}
+
+static double summary_joules(const struct summary* s) {
+	return s->energy * (ET_ENERGY_NJ * 1e-9);
+}
+
+static double summary_stddev(const struct summary* s) {
+	return s->count > 1 ? sqrt(s->m2 / (double)(s->count - 1)) : 0.0;
+}
+
+static void summary_print(struct summary* s, const char* title) {
+	double secs = summary_seconds(s);
+	double joules = summary_joules(s);
+	printf("#%s: %" PRIu64 " samples over %.6f s\n", title, s->count, secs);
+	if (s->count == 0)
+		return;
+	printf("#  current [nA]: mean %.1f, stddev %.1f, min %" PRIu32 ", max %" PRIu32 "\n",
+	       s->mean, summary_stddev(s), s->i_min, s->i_max);
+	printf("#  current quantiles [nA]: p1 %.0f, p10 %.0f, p50 %.0f, p90 %.0f, p99 %.0f, p99.9 %.0f\n",
+	       tdigest_quantile(&s->digest, 0.01), tdigest_quantile(&s->digest, 0.10),
+	       tdigest_quantile(&s->digest, 0.50), tdigest_quantile(&s->digest, 0.90),
+	       tdigest_quantile(&s->digest, 0.99), tdigest_quantile(&s->digest, 0.999));
+	printf("#  voltage [mV]: min %" PRIu32 ", max %" PRIu32 "\n", s->v_min, s->v_max);
+	printf("#  energy: %.9f J, average power: %.9f W\n", joules, secs > 0.0 ? joules / secs : 0.0);
+}
+
+/*
+ * Log-linear (HDR style) histograms of current and power.
+ *
+ * Values below 2^HIST_SUB_BITS get one bucket each; above that every power
+ * of two is split into 2^HIST_SUB_BITS equal buckets, so the relative
+ * resolution is about 3% from sub-microamp sleep currents up to the
+ * largest currents the probe can deliver. The bucket index is computed
+ * without branches from the position of the highest set bit.
+ */
+enum {
+	HIST_SUB_BITS = 5,
+	HIST_BUCKETS  = (65 - HIST_SUB_BITS) << HIST_SUB_BITS,
+};
+
+struct loghist {
+	uint64_t count[HIST_BUCKETS];
+	uint64_t total;
+};
+
+struct histograms {
+	struct loghist current;  /* nA */
+	struct loghist power;    /* pW (nA * mV) */
+};
+
+static unsigned msb64(uint64_t v) {
+#if defined(_MSC_VER)
+	unsigned long idx;
+#if defined(_M_X64) || defined(_M_ARM64)
+	_BitScanReverse64(&idx, v);
+#else
+	if (!_BitScanReverse(&idx, (unsigned long)(v >> 32)))
+		_BitScanReverse(&idx, (unsigned long)v);
+	else
+		idx += 32;
+#endif
+	return (unsigned)idx;
+#else
+	return 63u - (unsigned)__builtin_clzll(v);
+#endif
+}
+
+static unsigned hist_index(uint64_t v) {
+	unsigned shift = msb64(v | (1u << HIST_SUB_BITS)) - HIST_SUB_BITS;
+	return (shift << HIST_SUB_BITS) + (unsigned)(v >> shift);
+}
+
+/* Smallest value that lands in bucket idx; the bucket is 'width' wide. */
+static uint64_t hist_bucket_low(unsigned idx, uint64_t* width) {
+	if (idx < (2u << HIST_SUB_BITS)) {
+		*width = 1;
+		return idx;
+	}
+	unsigned shift = (idx >> HIST_SUB_BITS) - 1;
+	*width = (uint64_t)1 << shift;
+	return (uint64_t)(idx - (shift << HIST_SUB_BITS)) << shift;
+}
+
+static void histograms_add(struct histograms* h, const struct et_sample* s, uint32_t n) {
+	for (uint32_t i = 0; i < n; i++) {
+		h->current.count[hist_index(s[i].current)]++;
+		h->power.count[hist_index((uint64_t)s[i].current * s[i].voltage)]++;
+	}
+	h->current.total += n;
+	h->power.total += n;
+}
+
+static void loghist_dump(struct sink* out, const struct loghist* h, const char* name) {
+	uint64_t cum = 0;
+	sink_printf(out, "#histogram %s: %" PRIu64 " samples (low, high, count, cumulative fraction)\n",
+	            name, h->total);
+	for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+		if (h->count[i] == 0)
+			continue;
+		uint64_t width;
+		uint64_t low = hist_bucket_low(i, &width);
+		cum += h->count[i];
+		sink_printf(out, "#hist %s %" PRIu64 " %" PRIu64 " %" PRIu64 " %.6f\n",
+		            name, low, low + width - 1, h->count[i], (double)cum / (double)h->total);
+	}
+}
+
+static void histograms_dump(struct sink* out, const struct histograms* h) {
+	loghist_dump(out, &h->current, "current_nA");
+	loghist_dump(out, &h->power, "power_pW");
+}
+
+/* Set from a signal handler to have the histograms dumped into the output. */
+static volatile sig_atomic_t dump_requested;
+
+#ifndef _WIN32
+static void on_dump_signal(int sig) {
+	(void)sig;
+	dump_requested = 1;
+}
+#endif
+
+/* Set by a stage that has seen enough; ends the measurement early. */
+static volatile bool capture_stop;
+
+static void sleep_ms(unsigned int ms) {
+#ifdef _WIN32
+	Sleep(ms);
+#else
+	struct timespec ts = { (time_t)(ms / 1000), (long)(ms % 1000) * 1000000 };
+	nanosleep(&ts, NULL);
+#endif
+}
+
+/*
+ * Wait out the measurement duration, or less if a stage sets capture_stop.
+ * Signals such as SIGUSR1 don't cut it short.
+ */
+static void capture_wait(unsigned int seconds) {
+	enum { TICK_MS = 50 };
+	uint64_t end = host_time_us() + (uint64_t)seconds * 1000000;
+	uint64_t now;
+	while (!capture_stop && (now = host_time_us()) < end) {
+		uint64_t left_ms = (end - now + 999) / 1000;
+		sleep_ms(left_ms < TICK_MS ? (unsigned int)left_ms : TICK_MS);
+	}
+}
+
+/*
+ * Oscilloscope-style trigger: samples pass through a ring holding the last
+ * 'pre' samples, and only windows around threshold crossings of the current
+ * are written out (pre samples, the triggering one, then 'post' more). After
+ * a window the trigger stays blind for 'holdoff' samples. In single mode the
+ * capture stops after the first window.
+ */
+enum {
+	TRIGGER_DEFAULT_PRE  = 100,
+	TRIGGER_DEFAULT_POST = 400,
+};
+
+enum trigger_state { TRIG_ARMED, TRIG_POST, TRIG_HOLDOFF, TRIG_DONE };
+
+struct trigger {
+	uint32_t           level;     /* nA */
+	bool               falling;
+	bool               single;
+	uint32_t           pre, post, holdoff;
+	enum trigger_state state;
+	uint32_t           remaining;
+	bool               have_prev;
+	uint32_t           prev;
+	uint64_t           fired;
+	struct et_sample*  ring;
+	uint32_t*          ring_didt;
+	uint64_t*          ring_host;
+	uint32_t           head, len;  /* oldest entry, entries used */
+};
+
+static int trigger_init(struct trigger* t, uint32_t level, uint32_t pre, uint32_t post, uint32_t holdoff) {
+	memset(t, 0, sizeof(*t));
+	t->level = level;
+	t->pre = pre;
+	t->post = post;
+	t->holdoff = holdoff;
+	if (pre > 0) {
+		t->ring = malloc(pre * sizeof(*t->ring));
+		t->ring_didt = malloc(pre * sizeof(*t->ring_didt));
+		t->ring_host = malloc(pre * sizeof(*t->ring_host));
+		if (!t->ring || !t->ring_didt || !t->ring_host)
+			return -1;
+	}
+	return 0;
+}
+
+static void trigger_free(struct trigger* t) {
+	free(t->ring);
+	free(t->ring_didt);
+	free(t->ring_host);
+}
+
+static void trigger_push(struct trigger* t, const struct et_sample* s, const struct row_extras* x, uint32_t i) {
+	if (t->pre == 0)
+		return;
+	uint32_t slot = (t->head + t->len) % t->pre;
+	if (t->len == t->pre)
+		t->head = (t->head + 1) % t->pre;
+	else
+		t->len++;
+	t->ring[slot] = s[i];
+	t->ring_didt[slot] = (x && x->didt) ? x->didt[i] : 0;
+	t->ring_host[slot] = (x && x->host) ? x->host[i] : 0;
+}
+
+/* Write the pre-trigger history, oldest first, in at most two runs. */
+static void trigger_write_ring(struct trigger* t, struct sink* out, bool with_didt, bool with_host) {
+	while (t->len > 0) {
+		uint32_t run = t->head + t->len <= t->pre ? t->len : t->pre - t->head;
+		struct row_extras rx = { .didt = with_didt ? t->ring_didt + t->head : NULL,
+		                         .host = with_host ? t->ring_host + t->head : NULL };
+		write_samples(out, t->ring + t->head, run, &rx);
+		t->head = (t->head + run) % t->pre;
+		t->len -= run;
+	}
+	t->head = 0;
+}
+
+static void trigger_run(struct trigger* t, struct sink* out, const struct et_sample* s, uint32_t n,
+                        const struct row_extras* x) {
+	bool with_didt = x && x->didt;
+	bool with_host = x && x->host;
+	uint32_t span = 0;  /* first sample of the window part inside this block */
+
+	for (uint32_t i = 0; i < n; i++) {
+		uint32_t cur = s[i].current;
+		bool crossed = t->have_prev && (t->falling ? (t->prev > t->level && cur <= t->level)
+		                                           : (t->prev < t->level && cur >= t->level));
+		t->prev = cur;
+		t->have_prev = true;
+
+		switch (t->state) {
+		case TRIG_ARMED:
+			if (!crossed) {
+				trigger_push(t, s, x, i);
+				continue;
+			}
+			t->fired++;
+			sink_printf(out, "#trigger %" PRIu64 " at %" PRIu64 "\n", t->fired, s[i].timestamp);
+			trigger_write_ring(t, out, with_didt, with_host);
+			t->state = TRIG_POST;
+			t->remaining = t->post + 1;
+			span = i;
+			break;
+		case TRIG_HOLDOFF:
+			trigger_push(t, s, x, i);
+			if (--t->remaining == 0)
+				t->state = TRIG_ARMED;
+			continue;
+		case TRIG_POST:
+			break;
+		case TRIG_DONE:
+			continue;
+		}
+
+		if (--t->remaining == 0) {
+			struct row_extras rx = { .didt = with_didt ? x->didt + span : NULL,
+			                         .host = with_host ? x->host + span : NULL };
+			write_samples(out, s + span, i + 1 - span, &rx);
+			if (t->single) {
+				t->state = TRIG_DONE;
+				capture_stop = true;
+			} else if (t->holdoff > 0) {
+				t->state = TRIG_HOLDOFF;
+				t->remaining = t->holdoff;
+			} else {
+				t->state = TRIG_ARMED;
+			}
+		}
+	}
+
+	if (t->state == TRIG_POST) {
+		struct row_extras rx = { .didt = with_didt ? x->didt + span : NULL,
+		                         .host = with_host ? x->host + span : NULL };
+		write_samples(out, s + span, n - span, &rx);
+	}
+}
+
+/*
+ * Activity segmentation: a two-threshold (hysteresis) state machine splits
+ * the stream into sleep and active segments. A sleep segment turns active
+ * when the current reaches 'high' and an active one goes back to sleep when
+ * it drops below 'low'. Segments tile the timeline: each one lasts until
+ * the first sample of the next.
+ */
+struct segment {
+	bool     active;
+	uint64_t start;      /* us */
+	uint64_t duration;   /* us */
+	uint64_t energy;     /* energy counter increments */
+	uint32_t peak;       /* nA */
+	uint32_t mean;       /* nA */
+	uint64_t samples;
+};
+
+typedef void (*segment_fn)(void* ctx, const struct segment* seg);
+
+struct segmenter {
+	uint32_t       low, high;   /* nA */
+	segment_fn     done;
+	void*          ctx;
+	bool           started;
+	struct segment cur;
+	uint64_t       current_sum;
+	uint32_t       prev_energy;
+};
+
+static void segmenter_init(struct segmenter* g, uint32_t low, uint32_t high, segment_fn done, void* ctx) {
+	memset(g, 0, sizeof(*g));
+	g->low = low;
+	g->high = high;
+	g->done = done;
+	g->ctx = ctx;
+}
+
+/* Parse "LOW:HIGH" thresholds in nA. */
+static int parse_thresholds(const char* v, uint32_t* low, uint32_t* high) {
+	char* end;
+	*low = (uint32_t)strtoul(v, &end, 0);
+	if (*end != ':')
+		return -1;
+	*high = (uint32_t)strtoul(end + 1, &end, 0);
+	return (*end == '\0' && *low <= *high) ? 0 : -1;
+}
+
+static void segmenter_close(struct segmenter* g, uint64_t end) {
+	struct segment* c = &g->cur;
+	c->duration = end - c->start;
+	c->mean = (uint32_t)(g->current_sum / c->samples);
+	g->done(g->ctx, c);
+}
+
+static void segmenter_add(struct segmenter* g, const struct et_sample* s, uint32_t n) {
+	for (uint32_t i = 0; i < n; i++) {
+		struct segment* c = &g->cur;
+		if (!g->started) {
+			g->started = true;
+			c->active = s[i].current >= g->high;
+			c->start = s[i].timestamp;
+		} else {
+			/* The increment up to this sample belongs to the segment it ends. */
+			uint32_t de = s[i].energy - g->prev_energy;
+			if (de <= UINT32_MAX / 2)  /* ignore counter resets */
+				c->energy += de;
+			bool active = c->active ? s[i].current >= g->low : s[i].current >= g->high;
+			if (active != c->active) {
+				segmenter_close(g, s[i].timestamp);
+				memset(c, 0, sizeof(*c));
+				g->current_sum = 0;
+				c->active = active;
+				c->start = s[i].timestamp;
+			}
+		}
+		g->prev_energy = s[i].energy;
+		g->current_sum += s[i].current;
+		c->samples++;
+		if (s[i].current > c->peak)
+			c->peak = s[i].current;
+	}
+}
+
+/* Report the segment still open at the end of the capture. */
+static void segmenter_finish(struct segmenter* g, uint64_t end) {
+	if (g->started && g->cur.samples > 0)
+		segmenter_close(g, end > g->cur.start ? end : g->cur.start);
+	g->started = false;
+}
+
+/* Capture stage writing one row per segment instead of the samples. */
+struct segment_log {
+	struct segmenter seg;
+	struct sink*     out;
+	uint64_t         last_timestamp;
+	uint64_t         count[2];      /* sleep, active */
+	uint64_t         duration[2];
+	uint64_t         energy[2];
+};
+
+static void segment_log_row(void* ctx, const struct segment* g) {
+	struct segment_log* l = ctx;
+	char* row = sink_reserve(l->out, ET_ROW_MAX);
+	char* p = row;
+	p = put_u64(p, g->start, 20);
+	*p++ = ',';
+	p = put_u64(p, g->duration, 10);
+	*p++ = ',';
+	*p++ = g->active ? '1' : '0';
+	*p++ = ',';
+	p = put_u64(p, g->energy, 10);
+	*p++ = ',';
+	p = put_u64(p, g->peak, 10);
+	*p++ = ',';
+	p = put_u64(p, g->mean, 10);
+	*p++ = '\n';
+	sink_advance(l->out, (size_t)(p - row));
+
+	l->count[g->active]++;
+	l->duration[g->active] += g->duration;
+	l->energy[g->active] += g->energy;
+}
+
+static void segment_log_print(const struct segment_log* l) {
+	static const char* const names[2] = { "sleep", "active" };
+	uint64_t total = l->energy[0] + l->energy[1];
+	for (int k = 0; k < 2; k++) {
+		double joules = l->energy[k] * (ET_ENERGY_NJ * 1e-9);
+		printf("#Segments %s: %" PRIu64 ", %.6f s, %.9f J (%.1f%%), %.9f J and %.6f s each\n",
+		       names[k], l->count[k], l->duration[k] / 1e6, joules,
+		       total ? 100.0 * l->energy[k] / total : 0.0,
+		       l->count[k] ? joules / l->count[k] : 0.0,
+		       l->count[k] ? l->duration[k] / 1e6 / l->count[k] : 0.0);
+	}
+}
+
+/*
+ * Radix-2 complex FFT with a precomputed plan (bit-reversal permutation and
+ * twiddle factors), shared by the offline analyses.
+ */
+struct cpx {
+	double re, im;
+};
+
+struct fft {
+	uint32_t    n;     /* power of two */
+	uint32_t*   rev;
+	struct cpx* tw;    /* exp(-2 pi i k / n), k < n/2 */
+};
+
+static int fft_init(struct fft* f, uint32_t n) {
+	unsigned bits = 0;
+	while ((1u << bits) < n)
+		bits++;
+	f->n = n;
+	f->rev = malloc(n * sizeof(*f->rev));
+	f->tw = malloc((n / 2 + 1) * sizeof(*f->tw));
+	if (!f->rev || !f->tw || (1u << bits) != n)
+		return -1;
+	for (uint32_t i = 0; i < n; i++) {
+		uint32_t r = 0;
+		for (unsigned b = 0; b < bits; b++)
+			r |= ((i >> b) & 1u) << (bits - 1 - b);
+		f->rev[i] = r;
+	}
+	const double pi = 3.14159265358979323846;
+	for (uint32_t k = 0; k < n / 2; k++) {
+		double a = -2.0 * pi * k / n;
+		f->tw[k].re = cos(a);
+		f->tw[k].im = sin(a);
+	}
+	return 0;
+}
+
+static void fft_free(struct fft* f) {
+	free(f->rev);
+	free(f->tw);
+}
+
+/* In place; the inverse transform is not scaled by 1/n. */
+static void fft_run(const struct fft* f, struct cpx* a, bool inverse) {
+	uint32_t n = f->n;
+	for (uint32_t i = 0; i < n; i++) {
+		uint32_t r = f->rev[i];
+		if (i < r) {
+			struct cpx t = a[i];
+			a[i] = a[r];
+			a[r] = t;
+		}
+	}
+	for (uint32_t len = 2; len <= n; len <<= 1) {
+		uint32_t half = len / 2, step = n / len;
+		for (uint32_t i = 0; i < n; i += len) {
+			for (uint32_t j = 0; j < half; j++) {
+				struct cpx w = f->tw[j * step];
+				if (inverse)
+					w.im = -w.im;
+				struct cpx* u = &a[i + j];
+				struct cpx* v = &a[i + j + half];
+				double re = v->re * w.re - v->im * w.im;
+				double im = v->re * w.im + v->im * w.re;
+				v->re = u->re - re;
+				v->im = u->im - im;
+				u->re += re;
+				u->im += im;
+			}
+		}
+	}
+}
+
+/*
+ * Welch power spectral density of the current, computed while capturing:
+ * frames of 'n' samples overlapping by half are detrended (mean removed),
+ * Hann-windowed and transformed with a real FFT (a complex FFT of n/2
+ * points plus a split step), and their power spectra are averaged. Memory
+ * is one frame plus the spectrum, however long the capture.
+ */
+enum {
+	PSD_DEFAULT_N = 1024,
+	PSD_MIN_N     = 64,
+	PSD_MAX_N     = 65536,
+	PSD_PEAKS     = 5,
+};
+
+struct psd {
+	uint32_t    n;
+	struct fft  fft;       /* n/2 points */
+	double*     window;
+	double      window_power;  /* sum of squared window values */
+	struct cpx* tw;        /* exp(-2 pi i k / n), k < n/2 */
+	float*      frame;
+	uint32_t    fill;
+	struct cpx* z;
+	double*     power;     /* n/2 + 1 bins */
+	uint64_t    frames;
+	uint64_t    samples, first_timestamp, last_timestamp;
+};
+
+static int psd_init(struct psd* p, uint32_t n) {
+	const double pi = 3.14159265358979323846;
+	memset(p, 0, sizeof(*p));
+	p->n = n;
+	p->window = malloc(n * sizeof(*p->window));
+	p->tw = malloc(n / 2 * sizeof(*p->tw));
+	p->frame = malloc(n * sizeof(*p->frame));
+	p->z = malloc(n / 2 * sizeof(*p->z));
+	p->power = calloc(n / 2 + 1, sizeof(*p->power));
+	if (!p->window || !p->tw || !p->frame || !p->z || !p->power || fft_init(&p->fft, n / 2) != 0)
+		return -1;
+	for (uint32_t k = 0; k < n; k++) {
+		p->window[k] = 0.5 - 0.5 * cos(2.0 * pi * k / n);
+		p->window_power += p->window[k] * p->window[k];
+	}
+	for (uint32_t k = 0; k < n / 2; k++) {
+		p->tw[k].re = cos(-2.0 * pi * k / n);
+		p->tw[k].im = sin(-2.0 * pi * k / n);
+	}
+	return 0;
+}
+
+static void psd_free(struct psd* p) {
+	fft_free(&p->fft);
+	free(p->window);
+	free(p->tw);
+	free(p->frame);
+	free(p->z);
+	free(p->power);
+}
+
+static void psd_frame(struct psd* p) {
+	uint32_t n = p->n, h = n / 2;
+	double mean = 0.0;
+	for (uint32_t k = 0; k < n; k++)
+		mean += p->frame[k];
+	mean /= n;
+	for (uint32_t k = 0; k < h; k++) {
+		p->z[k].re = (p->frame[2 * k] - mean) * p->window[2 * k];
+		p->z[k].im = (p->frame[2 * k + 1] - mean) * p->window[2 * k + 1];
+	}
+	fft_run(&p->fft, p->z, false);
+	/* Split the packed even/odd transform into bins 0..n/2 of the real one. */
+	for (uint32_t k = 0; k <= h; k++) {
+		struct cpx a = p->z[k % h], b = p->z[(h - k) % h];
+		double er = 0.5 * (a.re + b.re), ei = 0.5 * (a.im - b.im);  /* even part */
+		double or_ = 0.5 * (a.im + b.im), oi = -0.5 * (a.re - b.re);  /* odd part */
+		double wr = k < h ? p->tw[k].re : -1.0, wi = k < h ? p->tw[k].im : 0.0;
+		double xr = er + wr * or_ - wi * oi;
+		double xi = ei + wr * oi + wi * or_;
+		p->power[k] += xr * xr + xi * xi;
+	}
+	p->frames++;
+}
+
+static void psd_add(struct psd* p, const struct et_sample* s, uint32_t n) {
+	if (p->samples == 0)
+		p->first_timestamp = s[0].timestamp;
+	p->samples += n;
+	p->last_timestamp = s[n - 1].timestamp;
+	for (uint32_t i = 0; i < n; i++) {
+		p->frame[p->fill++] = (float)s[i].current;
+		if (p->fill == p->n) {
+			psd_frame(p);
+			memmove(p->frame, p->frame + p->n / 2, p->n / 2 * sizeof(*p->frame));
+			p->fill = p->n / 2;
+		}
+	}
+}
+
+static double psd_sample_rate(const struct psd* p) {
+	uint64_t span = p->last_timestamp - p->first_timestamp;
+	return span > 0 ? (p->samples - 1) * 1e6 / span : 0.0;
+}
+
+/* One-sided density in nA^2/Hz, as "#psd" lines. */
+static void psd_dump(struct sink* out, const struct psd* p) {
+	double fs = psd_sample_rate(p);
+	uint32_t h = p->n / 2;
+	sink_printf(out, "#psd: %u-point Hann Welch, %" PRIu64 " frames, %.3f Hz sampling (frequency_Hz, nA^2/Hz)\n",
+	            p->n, p->frames, fs);
+	if (p->frames == 0 || fs <= 0.0)
+		return;
+	double scale = 1.0 / (fs * p->window_power * p->frames);
+	for (uint32_t k = 0; k <= h; k++)
+		sink_printf(out, "#psd %.6f %.6g\n", k * fs / p->n,
+		            p->power[k] * scale * (k == 0 || k == h ? 1.0 : 2.0));
+}
+
+/* The strongest local maxima of the spectrum, for the end-of-run report. */
+static void psd_print_peaks(const struct psd* p) {
+	double fs = psd_sample_rate(p);
+	uint32_t h = p->n / 2, best[PSD_PEAKS];
+	int found = 0;
+	if (p->frames == 0 || fs <= 0.0) {
+		printf("#PSD: not enough samples for one %u-point frame\n", p->n);
+		return;
+	}
+	for (uint32_t k = 1; k < h; k++) {
+		if (p->power[k] <= p->power[k - 1] || p->power[k] < p->power[k + 1])
+			continue;
+		int at = found < PSD_PEAKS ? found++ : PSD_PEAKS;
+		while (at > 0 && p->power[best[at - 1]] < p->power[k]) {
+			if (at < PSD_PEAKS)
+				best[at] = best[at - 1];
+			at--;
+		}
+		if (at < PSD_PEAKS)
+			best[at] = k;
+	}
+	printf("#PSD: %" PRIu64 " frames, %.3f Hz resolution; strongest lines:", p->frames, fs / p->n);
+	for (int i = 0; i < found; i++)
+		printf(" %.3f Hz", best[i] * fs / p->n);
+	printf("\n");
+}
+
+/*
+ * Battery life estimate: the current is integrated into charge in a 64-bit
+ * fixed-point accumulator of nA * us (1 mAh = 3.6e12, so it holds over
+ * 5000 Ah). Wake-ups are found with the same hysteresis as the segmenter,
+ * using thresholds of 10x / 5x the sleep floor (the 10th percentile of
+ * the first samples). The median interval between wake-ups is the
+ * dominant duty cycle. The average current is taken over whole cycles,
+ * from the first wake-up to the latest, so a partial cycle at either end
+ * doesn't bias it. Lifetime = capacity / (average current + the
+ * self-discharge expressed as a current). The estimate is redone at every
+ * wake-up. Once the last BATTERY_WINDOW estimates agree within the
+ * convergence limit, the capture can stop.
+ */
+enum {
+	BATTERY_WARMUP      = 2000,      /* samples for the sleep floor */
+	BATTERY_MIN_FLOOR   = 100,       /* nA */
+	BATTERY_WINDOW      = 32,        /* estimates that must agree */
+	BATTERY_REPORT_US   = 1000000,   /* live report interval */
+};
+
+#define BATTERY_NAUS_PER_MAH 3.6e12
+#define BATTERY_HOURS_PER_YEAR 8766.0
+#define BATTERY_DEFAULT_CONVERGE 1.0  /* percent */
+
+struct battery {
+	double         capacity;     /* mAh */
+	double         self_discharge;  /* % of capacity per year */
+	double         converge;     /* relative spread to stop at, 0 to keep going */
+	struct tdigest warmup;
+	uint64_t       warmup_samples;
+	uint32_t       low, high;    /* nA, set after the warm-up */
+	bool           have_prev, active;
+	uint64_t       prev_timestamp;
+	uint32_t       prev_current;
+	uint64_t       first_timestamp;
+	uint64_t       charge;       /* nA * us */
+	uint64_t       active_time;  /* us */
+	uint64_t       wakeups;
+	uint64_t       first_wake, last_wake;        /* us */
+	uint64_t       first_wake_charge, last_wake_charge;
+	struct tdigest intervals;
+	double         estimate[BATTERY_WINDOW];     /* hours, ring */
+	uint64_t       estimates;
+	bool           converged;
+	uint64_t       converged_at;                 /* us since the first sample */
+	uint64_t       next_report;
+};
+
+static void battery_init(struct battery* b, double capacity, double self_discharge, double converge) {
+	memset(b, 0, sizeof(*b));
+	b->capacity = capacity;
+	b->self_discharge = self_discharge;
+	b->converge = converge;
+	tdigest_init(&b->warmup);
+	tdigest_init(&b->intervals);
+}
+
+/* "MAH[:PCT]": capacity and optional self-discharge in percent per year. */
+static int parse_battery(const char* v, double* capacity, double* self_discharge) {
+	char* end;
+	*capacity = strtod(v, &end);
+	*self_discharge = 0.0;
+	if (*end == ':')
+		*self_discharge = strtod(end + 1, &end);
+	return (*end == '\0' && *capacity > 0.0 && *self_discharge >= 0.0) ? 0 : -1;
+}
+
+static double battery_self_current(const struct battery* b) {
+	return b->capacity * b->self_discharge / 100.0 / BATTERY_HOURS_PER_YEAR * 1e6;  /* nA */
+}
+
+/* Average current in nA: over whole cycles once there are two wake-ups, else overall. */
+static double battery_average(const struct battery* b) {
+	if (b->wakeups >= 2 && b->last_wake > b->first_wake)
+		return (double)(b->last_wake_charge - b->first_wake_charge) / (b->last_wake - b->first_wake);
+	uint64_t span = b->prev_timestamp - b->first_timestamp;
+	return span > 0 ? (double)b->charge / span : 0.0;
+}
+
+static double battery_hours(const struct battery* b) {
+	double na = battery_average(b) + battery_self_current(b);
+	return na > 0.0 ? b->capacity * 1e6 / na : INFINITY;
+}
+
+/* Relative spread of the last BATTERY_WINDOW estimates, or infinity until there are that many. */
+static double battery_spread(const struct battery* b) {
+	if (b->estimates < BATTERY_WINDOW)
+		return INFINITY;
+	double lo = INFINITY, hi = 0.0;
+	for (int i = 0; i < BATTERY_WINDOW; i++) {
+		if (b->estimate[i] < lo)
+			lo = b->estimate[i];
+		if (b->estimate[i] > hi)
+			hi = b->estimate[i];
+	}
+	return hi > 0.0 ? (hi - lo) / hi : 0.0;
+}
+
+static void battery_estimate(struct battery* b) {
+	b->estimate[b->estimates++ % BATTERY_WINDOW] = battery_hours(b);
+	if (b->converge > 0.0 && !b->converged && battery_spread(b) <= b->converge) {
+		b->converged = true;
+		b->converged_at = b->prev_timestamp - b->first_timestamp;
+		capture_stop = true;
+	}
+}
+
+static void battery_add(struct battery* b, struct sink* out, const struct et_sample* s, uint32_t n) {
+	for (uint32_t i = 0; i < n; i++) {
+		uint32_t cur = s[i].current;
+		if (!b->have_prev) {
+			b->have_prev = true;
+			b->first_timestamp = s[i].timestamp;
+			b->next_report = s[i].timestamp + BATTERY_REPORT_US;
+		} else {
+			uint64_t dt = s[i].timestamp - b->prev_timestamp;
+			b->charge += (uint64_t)b->prev_current * dt;
+			if (b->active)
+				b->active_time += dt;
+		}
+		b->prev_timestamp = s[i].timestamp;
+		b->prev_current = cur;
+
+		if (b->high == 0) {
+			tdigest_add(&b->warmup, cur);
+			if (++b->warmup_samples == BATTERY_WARMUP) {
+				double floor_na = tdigest_quantile(&b->warmup, 0.1);
+				if (floor_na < BATTERY_MIN_FLOOR)
+					floor_na = BATTERY_MIN_FLOOR;
+				b->low = (uint32_t)(5.0 * floor_na);
+				b->high = (uint32_t)(10.0 * floor_na);
+			}
+		} else if (b->active) {
+			b->active = cur >= b->low;
+		} else if (cur >= b->high) {
+			b->active = true;
+			if (b->wakeups++ == 0) {
+				b->first_wake = s[i].timestamp;
+				b->first_wake_charge = b->charge;
+			} else {
+				tdigest_add(&b->intervals, (double)(s[i].timestamp - b->last_wake));
+			}
+			b->last_wake = s[i].timestamp;
+			b->last_wake_charge = b->charge;
+			if (b->wakeups >= 2)
+				battery_estimate(b);
+		}
+
+		if (s[i].timestamp >= b->next_report) {
+			b->next_report += BATTERY_REPORT_US;
+			/* Without wake-ups there are no cycles; estimate on the report tick instead. */
+			if (b->high != 0 && b->wakeups < 2)
+				battery_estimate(b);
+			sink_printf(out, "#battery %.3f s: %.9f mAh, average %.3f uA, life %.2f days, spread %.3f%%\n",
+			            (s[i].timestamp - b->first_timestamp) / 1e6, b->charge / BATTERY_NAUS_PER_MAH,
+			            battery_average(b) / 1e3, battery_hours(b) / 24.0, 100.0 * battery_spread(b));
+		}
+	}
+}
+
+static void battery_print(struct battery* b) {
+	double hours = battery_hours(b);
+	printf("#Battery: %.3f mAh, self-discharge %.2f %%/year (%.3f uA)\n",
+	       b->capacity, b->self_discharge, battery_self_current(b) / 1e3);
+	printf("#  charge: %.9f mAh over %.3f s, average %.3f uA\n", b->charge / BATTERY_NAUS_PER_MAH,
+	       (b->prev_timestamp - b->first_timestamp) / 1e6,
+	       b->prev_timestamp > b->first_timestamp ? b->charge / 1e3 / (b->prev_timestamp - b->first_timestamp) : 0.0);
+	if (b->wakeups >= 2)
+		printf("#  duty cycle: %" PRIu64 " wake-ups (above %" PRIu32 " nA), period %.3f ms (median), "
+		       "active %.3f%%, %.3f uA over whole cycles\n", b->wakeups, b->high,
+		       tdigest_quantile(&b->intervals, 0.5) / 1e3,
+		       100.0 * b->active_time / (b->prev_timestamp - b->first_timestamp), battery_average(b) / 1e3);
+	else
+		printf("#  duty cycle: none found (no wake-ups above %" PRIu32 " nA)\n", b->high);
+	printf("#  projected life: %.1f h = %.2f days = %.3f years, spread of the last %d estimates %.3f%%",
+	       hours, hours / 24.0, hours / BATTERY_HOURS_PER_YEAR, BATTERY_WINDOW, 100.0 * battery_spread(b));
+	if (b->converged)
+		printf(", converged after %.3f s\n", b->converged_at / 1e6);
+	else
+		printf("\n");
+}
+
+/*
+ * Statistical auto-stop: the first AUTOSTOP_BINS ms of current are binned
+ * per millisecond and the workload period is found from their
+ * autocorrelation (computed with an FFT). The search skips the first lobe
+ * and takes the shortest lag whose peak is close to the best one, so the
+ * full pattern wins over its harmonics. From then on, the capture is cut
+ * into consecutive windows of one period, the warm-up included. Each
+ * window's energy is one observation. The capture stops once the 95%
+ * confidence interval of the mean is narrower than the target, relative
+ * to the mean.
+ */
+enum {
+	AUTOSTOP_BIN_US      = 1000,
+	AUTOSTOP_BINS        = 8192,    /* periods up to half of this */
+	AUTOSTOP_MIN_PERIODS = 10,
+	AUTOSTOP_FALLBACK_US = 100000,  /* window when nothing repeats */
+};
+
+#define AUTOSTOP_DEFAULT_TARGET 1.0     /* percent */
+#define AUTOSTOP_MIN_CORRELATION 0.5
+
+struct autostop {
+	double   target;        /* relative CI half-width */
+	bool     started, detected, done;
+	uint64_t t0;
+	uint32_t nbins;
+	double   sum[AUTOSTOP_BINS];
+	uint32_t count[AUTOSTOP_BINS];
+	uint32_t energy[AUTOSTOP_BINS];  /* energy counter at the first sample of each bin */
+	double   period;        /* us */
+	double   correlation;
+	double   boundary;      /* start of the current window, us */
+	uint32_t boundary_energy;
+	uint64_t periods;
+	double   mean, m2;      /* energy per period, counter increments */
+	uint64_t stopped_at;    /* us since the first sample */
+};
+
+static void autostop_init(struct autostop* a, double target) {
+	memset(a, 0, sizeof(*a));
+	a->target = target;
+}
+
+/* Two-sided 95% quantile of Student's t with 'df' degrees of freedom (Cornish-Fisher). */
+static double student_t95(double df) {
+	const double z = 1.959963985;
+	double z3 = z * z * z, z5 = z3 * z * z;
+	return z + (z3 + z) / (4.0 * df) + (5.0 * z5 + 16.0 * z3 + 3.0 * z) / (96.0 * df * df);
+}
+
+static double autostop_halfwidth(const struct autostop* a) {
+	if (a->periods < 2)
+		return INFINITY;
+	double n = (double)a->periods;
+	return student_t95(n - 1.0) * sqrt(a->m2 / (n - 1.0) / n);
+}
+
+static void autostop_period(struct autostop* a, struct sink* out, uint32_t de, uint64_t now) {
+	double d = de - a->mean;
+	a->periods++;
+	a->mean += d / (double)a->periods;
+	a->m2 += d * (de - a->mean);
+	if (!a->done && a->periods >= AUTOSTOP_MIN_PERIODS && autostop_halfwidth(a) <= a->target * a->mean) {
+		a->done = true;
+		a->stopped_at = now - a->t0;
+		capture_stop = true;
+		sink_printf(out, "#autostop at %" PRIu64 ": %" PRIu64 " periods, energy per period %.9f J +- %.3f%%\n",
+		            now, a->periods, a->mean * (ET_ENERGY_NJ * 1e-9),
+		            a->mean > 0.0 ? 100.0 * autostop_halfwidth(a) / a->mean : 0.0);
+	}
+}
+
+/* Find the period from the warm-up bins and replay them as whole windows. */
+static void autostop_detect(struct autostop* a, struct sink* out) {
+	enum { N = AUTOSTOP_BINS };
+	static struct cpx x[2 * N];
+	static double r[N / 2 + 2];
+	struct fft fft;
+	double mean = 0.0;
+
+	for (uint32_t i = 0; i < N; i++) {
+		if (a->count[i] == 0) {  /* gap: hold the previous bin */
+			a->sum[i] = i ? a->sum[i - 1] : 0.0;
+			a->count[i] = 1;
+			a->energy[i] = i ? a->energy[i - 1] : 0;
+		} else {
+			a->sum[i] /= a->count[i];
+			a->count[i] = 1;
+		}
+		mean += a->sum[i];
+	}
+	mean /= N;
+
+	a->period = AUTOSTOP_FALLBACK_US;
+	if (fft_init(&fft, 2 * N) == 0) {
+		for (uint32_t i = 0; i < 2 * N; i++)
+			x[i] = (struct cpx){ i < N ? a->sum[i] - mean : 0.0, 0.0 };
+		fft_run(&fft, x, false);
+		for (uint32_t i = 0; i < 2 * N; i++)
+			x[i] = (struct cpx){ x[i].re * x[i].re + x[i].im * x[i].im, 0.0 };
+		fft_run(&fft, x, true);
+		for (uint32_t lag = 0; lag <= N / 2 + 1; lag++)
+			r[lag] = x[0].re > 0.0 ? (x[lag].re / (N - lag)) / (x[0].re / N) : 0.0;
+
+		uint32_t lag = 1, best = 0;
+		while (lag < N / 2 && r[lag] > 0.0)  /* skip the lobe around zero */
+			lag++;
+		for (uint32_t k = lag; k <= N / 2; k++)
+			if (r[k] >= r[k - 1] && r[k] > r[k + 1] && (best == 0 || r[k] > r[best]))
+				best = k;
+		if (best != 0 && r[best] >= AUTOSTOP_MIN_CORRELATION) {
+			for (uint32_t k = lag; k <= best; k++) {
+				if (r[k] >= r[k - 1] && r[k] > r[k + 1] && r[k] >= 0.9 * r[best]) {
+					best = k;
+					break;
+				}
+			}
+			/* Parabolic interpolation around the peak. */
+			double y0 = r[best - 1], y1 = r[best], y2 = r[best + 1];
+			double den = y0 - 2.0 * y1 + y2, shift = den != 0.0 ? 0.5 * (y0 - y2) / den : 0.0;
+			a->period = (best + shift) * AUTOSTOP_BIN_US;
+			a->correlation = y1;
+		}
+		fft_free(&fft);
+	}
+	a->detected = true;
+	sink_printf(out, "#autostop: period %.3f ms (correlation %.3f)\n", a->period / 1e3, a->correlation);
+
+	a->boundary = (double)a->t0;
+	a->boundary_energy = a->energy[0];
+	for (;;) {
+		double end = a->boundary + a->period;
+		uint32_t bin = (uint32_t)((end - a->t0) / AUTOSTOP_BIN_US);
+		if (bin >= N)
+			break;
+		autostop_period(a, out, a->energy[bin] - a->boundary_energy, (uint64_t)end);
+		a->boundary = end;
+		a->boundary_energy = a->energy[bin];
+	}
+}
+
+static void autostop_add(struct autostop* a, struct sink* out, const struct et_sample* s, uint32_t n) {
+	for (uint32_t i = 0; i < n; i++) {
+		if (!a->started) {
+			a->started = true;
+			a->t0 = s[i].timestamp;
+		}
+		if (!a->detected) {
+			uint64_t bin = (s[i].timestamp - a->t0) / AUTOSTOP_BIN_US;
+			if (bin < AUTOSTOP_BINS) {
+				if (a->count[bin]++ == 0)
+					a->energy[bin] = s[i].energy;
+				a->sum[bin] += s[i].current;
+				continue;
+			}
+			autostop_detect(a, out);
+		}
+		if (s[i].timestamp >= a->boundary + a->period) {
+			autostop_period(a, out, s[i].energy - a->boundary_energy, s[i].timestamp);
+			while (a->boundary + a->period <= s[i].timestamp)
+				a->boundary += a->period;
+			a->boundary_energy = s[i].energy;
+		}
+	}
+}
+
+static void autostop_print(const struct autostop* a, unsigned int duration) {
+	if (!a->detected) {
+		printf("#Auto-stop: capture ended during the %.3f s warm-up\n", AUTOSTOP_BINS * AUTOSTOP_BIN_US / 1e6);
+		return;
+	}
+	double joules = a->mean * (ET_ENERGY_NJ * 1e-9);
+	printf("#Auto-stop: period %.3f ms (%s), %" PRIu64 " periods\n", a->period / 1e3,
+	       a->correlation > 0.0 ? "autocorrelation" : "nothing repeats, fixed window", a->periods);
+	printf("#  energy per period: %.9f J +- %.3f%% (95%% confidence), average power %.9f W\n", joules,
+	       a->mean > 0.0 ? 100.0 * autostop_halfwidth(a) / a->mean : 0.0, joules / (a->period / 1e6));
+	if (a->done)
+		printf("#  stopped after %.3f s of at most %u s\n", a->stopped_at / 1e6, duration);
+	else
+		printf("#  target of %.3f%% not reached in %u s\n", 100.0 * a->target, duration);
+}
+
+/*
+ * Region measurement: EEM breakpoints on a start and a stop address split
+ * execution into iterations of the code between them. Samples only arrive
+ * while the target runs (ET_CALLBACKS_ONLY_DURING_RUN), so while it is
+ * halted at a breakpoint the main thread can safely switch recording on or
+ * off. It first waits until no more callbacks come, so late samples still
+ * go to the right iteration. With --cycles, EEM cycle counter 0 is cleared
+ * at the start breakpoint and read at the stop one, from the same thread,
+ * so the callbacks never wait on JTAG.
+ */
+enum {
+	REGION_DEFAULT_ITERATIONS = 10,
+	REGION_QUIET_MS           = 50,
+	REGION_POLL_MS            = 1,
+};
+
+struct region {
+	mutex_t  lock;
+	bool     recording;
+	uint64_t last_push;       /* host time of the latest block, us */
+	uint64_t samples;
+	uint64_t first_timestamp, last_timestamp;  /* first is the sample before recording started */
+	uint32_t first_energy, last_energy;
+};
+
+struct region_result {
+	uint64_t duration;  /* us */
+	uint32_t energy;    /* energy counter increments */
+	uint64_t samples;
+	uint64_t cycles;    /* CPU cycles, 0 without --cycles */
+};
+
+/* Samples are followed even while not recording, to know where the next iteration starts. */
+static void region_add(struct region* r, const struct et_sample* s, uint32_t n) {
+	mutex_lock(&r->lock);
+	r->last_push = host_time_us();
+	if (r->recording)
+		r->samples += n;
+	r->last_timestamp = s[n - 1].timestamp;
+	r->last_energy = s[n - 1].energy;
+	mutex_unlock(&r->lock);
+}
+
+/* Wait until the callbacks have been quiet for REGION_QUIET_MS, then start or stop recording. */
+static void region_switch(struct region* r, bool recording, struct region_result* res) {
+	for (;;) {
+		mutex_lock(&r->lock);
+		if (host_time_us() - r->last_push >= REGION_QUIET_MS * 1000)
+			break;
+		mutex_unlock(&r->lock);
+		sleep_ms(REGION_POLL_MS);
+	}
+	if (res) {
+		res->samples = r->samples;
+		res->duration = r->samples ? r->last_timestamp - r->first_timestamp : 0;
+		res->energy = r->samples ? r->last_energy - r->first_energy : 0;
+	}
+	r->recording = recording;
+	r->samples = 0;
+	r->first_timestamp = r->last_timestamp;
+	r->first_energy = r->last_energy;
+	mutex_unlock(&r->lock);
+}
+
+/*
+ * Firmware variable watch: a thread reads target RAM with MSP430_Memory
+ * every --watch-interval ms while the capture runs. All watched variables
+ * are covered by one read, so each poll costs a single JTAG transaction.
+ * A read is placed on the EnergyTrace timeline at the latest sample plus
+ * the host time since it arrived, and its energy extrapolated at the power
+ * of that block. The sample callback writes the reads into the output as
+ * '#watch' lines after the block they fall in. Only reads still waiting
+ * for their line are kept; the report is fitted as the reads come in.
+ */
+enum {
+	WATCH_MAX_VARS            = 8,
+	WATCH_MAX_SPAN            = 256,  /* bytes in one read */
+	WATCH_DEFAULT_INTERVAL_MS = 10,
+	WATCH_PENDING             = 256,  /* reads waiting for the next block */
+};
+
+struct watch_read {
+	uint64_t timestamp;  /* us, EnergyTrace timeline */
+	double   energy;     /* energy counter increments */
+	uint32_t value[WATCH_MAX_VARS];
+};
+
+/* Running least-squares fit of energy (y, J) against the unwrapped value (x). */
+struct watch_fit {
+	uint32_t prev;
+	double   x, mx, my, sxx, sxy, syy;
+};
+
+struct watch {
+	mutex_t  lock;
+	bool     seen;            /* a sample block arrived, so the timeline is known */
+	uint64_t last_push;       /* host time of the latest block, us */
+	uint64_t last_timestamp;
+	uint32_t last_energy;
+	double   rate;            /* energy increments per us over the latest block */
+	uint32_t addr[WATCH_MAX_VARS];
+	unsigned int size[WATCH_MAX_VARS];  /* bytes: 1, 2 or 4 */
+	unsigned int nvars;
+	uint32_t base, span;
+	unsigned int interval_ms;
+	struct watch_read pending[WATCH_PENDING];
+	unsigned int phead, pcount;
+	uint64_t n, dropped;
+	uint64_t first_timestamp, last_read;
+	double   first_energy;
+	struct watch_fit fit[WATCH_MAX_VARS];
+	uint64_t failed;
+	volatile bool done;
+	thread_t thread;
+};
+
+/* Parse ADDR[:BYTES][,ADDR[:BYTES]...]; the variables must fit in one read. */
+static int watch_init(struct watch* w, const char* spec, unsigned int interval_ms) {
+	memset(w, 0, sizeof(*w));
+	w->interval_ms = interval_ms;
+	const char* p = spec;
+	uint32_t end = 0;
+	while (*p) {
+		char* next;
+		if (w->nvars == WATCH_MAX_VARS)
+			return -1;
+		w->addr[w->nvars] = (uint32_t)strtoul(p, &next, 0);
+		w->size[w->nvars] = 2;
+		if (next == p)
+			return -1;
+		if (*next == ':')
+			w->size[w->nvars] = (unsigned int)strtoul(next + 1, &next, 0);
+		if (w->size[w->nvars] != 1 && w->size[w->nvars] != 2 && w->size[w->nvars] != 4)
+			return -1;
+		if (w->nvars == 0 || w->addr[w->nvars] < w->base)
+			w->base = w->addr[w->nvars];
+		if (w->addr[w->nvars] + w->size[w->nvars] > end)
+			end = w->addr[w->nvars] + w->size[w->nvars];
+		w->nvars++;
+		if (*next == ',')
+			next++;
+		else if (*next != '\0')
+			return -1;
+		p = next;
+	}
+	w->span = end - w->base;
+	if (w->nvars == 0 || w->span > WATCH_MAX_SPAN)
+		return -1;
+	mutex_init(&w->lock);
+	return 0;
+}
+
+static uint32_t watch_value(const struct watch* w, const uint8_t* buf, unsigned int i) {
+	uint32_t v = 0;
+	for (unsigned int b = w->size[i]; b-- > 0;)
+		v = v << 8 | buf[w->addr[i] - w->base + b];
+	return v;
+}
+
+/* Fold a read into the per-variable fits (Welford-style co-moments). */
+static void watch_fit_add(struct watch* w, const struct watch_read* r) {
+	if (w->n == 0) {
+		w->first_timestamp = r->timestamp;
+		w->first_energy = r->energy;
+	}
+	w->last_read = r->timestamp;
+	double y = (r->energy - w->first_energy) * (ET_ENERGY_NJ * 1e-9);
+	for (unsigned int i = 0; i < w->nvars; i++) {
+		struct watch_fit* f = &w->fit[i];
+		double mask = w->size[i] == 4 ? 4294967296.0 : (double)(1u << (8 * w->size[i]));
+		if (w->n > 0)
+			f->x += fmod(r->value[i] - (double)f->prev + mask, mask);
+		f->prev = r->value[i];
+		double dx = f->x - f->mx, dy = y - f->my;
+		f->mx += dx / (w->n + 1);
+		f->my += dy / (w->n + 1);
+		f->sxx += dx * (f->x - f->mx);
+		f->sxy += dx * (y - f->my);
+		f->syy += dy * (y - f->my);
+	}
+	w->n++;
+}
+
+/* Queue a read for its '#watch' line, dropping the oldest if no block came for a while. */
+static void watch_queue(struct watch* w, const struct watch_read* r) {
+	if (w->pcount == WATCH_PENDING) {
+		w->phead = (w->phead + 1) % WATCH_PENDING;
+		w->pcount--;
+		w->dropped++;
+	}
+	w->pending[(w->phead + w->pcount++) % WATCH_PENDING] = *r;
+}
+
+static void* watch_thread(void* arg) {
+	struct watch* w = arg;
+	struct watch_read r;
+	uint8_t buf[WATCH_MAX_SPAN];
+	uint64_t next = host_time_us();
+	while (!w->done) {
+		uint64_t before = host_time_us();
+		STATUS_T status = MSP430_Memory((int32_t)w->base, buf, (int32_t)w->span, READ);
+		uint64_t at = before + (host_time_us() - before) / 2;
+		mutex_lock(&w->lock);
+		if (status != STATUS_OK) {
+			w->failed++;
+		} else if (w->seen) {
+			uint64_t ahead = at > w->last_push ? at - w->last_push : 0;
+			r.timestamp = w->last_timestamp + ahead;
+			r.energy = w->last_energy + w->rate * ahead;
+			for (unsigned int i = 0; i < w->nvars; i++)
+				r.value[i] = watch_value(w, buf, i);
+			watch_fit_add(w, &r);
+			watch_queue(w, &r);
+		}
+		mutex_unlock(&w->lock);
+		next += (uint64_t)w->interval_ms * 1000;
+		uint64_t now = host_time_us();
+		if (next > now)
+			sleep_ms((unsigned int)((next - now + 999) / 1000));
+		else
+			next = now;
+	}
+	return NULL;
+}
+
+/*
+ * Write out the reads taken while this block was on its way, which mostly
+ * fall within it, then follow the timeline.
+ */
+static void watch_add(struct watch* w, struct sink* out, const struct et_sample* s, uint32_t n) {
+	mutex_lock(&w->lock);
+	for (; w->pcount > 0; w->pcount--, w->phead = (w->phead + 1) % WATCH_PENDING) {
+		const struct watch_read* r = &w->pending[w->phead];
+		sink_printf(out, "#watch %" PRIu64, r->timestamp);
+		for (unsigned int i = 0; i < w->nvars; i++)
+			sink_printf(out, " %" PRIu32, r->value[i]);
+		sink_printf(out, "\n");
+	}
+	if (w->seen && s[n - 1].timestamp > w->last_timestamp)
+		w->rate = (double)(s[n - 1].energy - w->last_energy) / (double)(s[n - 1].timestamp - w->last_timestamp);
+	w->seen = true;
+	w->last_push = host_time_us();
+	w->last_timestamp = s[n - 1].timestamp;
+	w->last_energy = s[n - 1].energy;
+	mutex_unlock(&w->lock);
+}
+
+static int watch_start(struct watch* w) {
+	return thread_create(&w->thread, watch_thread, w);
+}
+
+static void watch_stop(struct watch* w) {
+	w->done = true;
+	thread_join(w->thread);
+}
+
+/*
+ * Energy per increment of each variable: the least-squares slope of the
+ * energy against the unwrapped value over all reads, which averages out
+ * the jitter of where a read lands on the timeline.
+ */
+static void watch_print(const struct watch* w) {
+	printf("#Watch: %" PRIu64 " reads of %" PRIu32 " bytes at 0x%05" PRIx32 " every %u ms, %" PRIu64
+	       " failed, %" PRIu64 " lines dropped\n",
+	       w->n, w->span, w->base, w->interval_ms, w->failed, w->dropped);
+	if (w->n < 3)
+		return;
+	double seconds = (w->last_read - w->first_timestamp) / 1e6;
+	for (unsigned int i = 0; i < w->nvars; i++) {
+		const struct watch_fit* f = &w->fit[i];
+		printf("#  0x%05" PRIx32 " (%u bytes): %.0f increments in %.3f s, %.3f per second",
+		       w->addr[i], w->size[i], f->x, seconds, seconds > 0.0 ? f->x / seconds : 0.0);
+		if (f->sxx > 0.0) {
+			double slope = f->sxy / f->sxx;
+			double se = sqrt(fmax(f->syy - slope * f->sxy, 0.0) / (w->n - 2) / f->sxx);
+			printf(", %.9f J per increment +- %.9f J (95%% confidence)",
+			       slope, student_t95(w->n - 2.0) * se);
+		}
+		printf("\n");
+	}
+}
+
+static void watch_free(struct watch* w) {
+	mutex_destroy(&w->lock);
+}
+
+/*
+ * Measurement plans run several phases in one session. Between phases the
+ * main thread calls MSP430_ResetEnergyTrace, and the sample callback steps
+ * to the next phase where the energy counter or timestamp drops back, so
+ * every sample is counted in the phase it was taken in. The main thread
+ * only times a phase once the callback has entered it, so short phases are
+ * never skipped. A phase given as a sample count drops the samples past
+ * its count until the next phase begins.
+ */
+enum {
+	PLAN_MAX_PHASES           = 256,
+	PLAN_POLL_MS              = 1,
+	PLAN_MIN_RATE_HZ          = 500,   /* well below the EnergyTrace sample rate */
+	PLAN_SAMPLES_SLACK_MS     = 2000,  /* to enter a phase, and on top of a counted one */
+	SWEEP_DEFAULT_STEP        = 100,  /* mV */
+	SWEEP_DEFAULT_SETTLE_MS   = 500,
+};
+
+enum plan_run { PLAN_RUN_FREE, PLAN_RUN_JTAG, PLAN_RUN_HALT };
+static const char* const plan_run_names[] = { "free", "jtag", "halt" };
+
+struct plan_phase {
+	long     vcc;      /* mV */
+	int      run;      /* enum plan_run */
+	double   seconds;  /* 0 if the phase is a sample count */
+	uint64_t samples;
+	bool     reset;    /* reset the target first */
+	bool     settle;   /* settling time for the next phase, left out of the report */
+};
+
+struct plan {
+	struct plan_phase phase[PLAN_MAX_PHASES];
+	unsigned int      n;
+	double            seconds;  /* total of the timed phases */
+};
+
+struct phase_result {
+	uint64_t samples;
+	double   seconds, joules;
+	double   mean, stddev;           /* current, nA */
+	uint32_t peak;
+};
+
+struct phases {
+	const struct plan*    plan;
+	mutex_t               lock;       /* guards requested, current, taken and full */
+	unsigned int          requested;  /* phase the main thread has switched to */
+	unsigned int          current;    /* phase the callback is in */
+	uint64_t              taken;      /* samples in the current phase */
+	bool                  full;       /* a counted phase has all its samples */
+	bool                  seen;
+	uint32_t              last_energy;
+	uint64_t              last_timestamp;
+	struct summary        summary;
+	struct phase_result   result[PLAN_MAX_PHASES];
+};
+
+static void phases_init(struct phases* p, const struct plan* plan) {
+	memset(p, 0, sizeof(*p));
+	p->plan = plan;
+	mutex_init(&p->lock);
+	summary_reset(&p->summary);
+}
+
+/*
+ * A new phase starts at the first energy counter or timestamp drop after the
+ * main thread asked for it. The timestamp also catches a phase that ended
+ * with the energy counter still at 0.
+ */
+static bool phases_boundary(struct phases* p, const struct et_sample* s) {
+	if (!p->seen || (s->energy - p->last_energy <= UINT32_MAX / 2 && s->timestamp >= p->last_timestamp))
+		return false;
+	mutex_lock(&p->lock);
+	bool pending = p->requested != p->current;
+	mutex_unlock(&p->lock);
+	return pending;
+}
+
+/* Whether the sample belongs in the capture, i.e. is within its phase's count. */
+static bool phases_accept(struct phases* p, const struct et_sample* s) {
+	uint64_t count = p->plan->phase[p->current].samples;
+	p->seen = true;
+	p->last_energy = s->energy;
+	p->last_timestamp = s->timestamp;
+	if (count && p->taken >= count)
+		return false;
+	mutex_lock(&p->lock);
+	if (++p->taken == count)
+		p->full = true;
+	mutex_unlock(&p->lock);
+	return true;
+}
+
+static void phases_close(struct phases* p) {
+	struct phase_result* r = &p->result[p->current];
+	r->samples = p->summary.count;
+	r->seconds = summary_seconds(&p->summary);
+	r->joules = summary_joules(&p->summary);
+	r->mean = p->summary.mean;
+	r->stddev = summary_stddev(&p->summary);
+	r->peak = p->summary.count ? p->summary.i_max : 0;
+}
+
+static void phases_next(struct phases* p, struct sink* out) {
+	phases_close(p);
+	mutex_lock(&p->lock);
+	p->current++;
+	p->taken = 0;
+	p->full = false;
+	mutex_unlock(&p->lock);
+	summary_reset(&p->summary);
+	const struct plan_phase* ph = &p->plan->phase[p->current];
+	sink_printf(out, "#phase %u: vcc %ld mV, run %s%s\n", p->current + 1, ph->vcc, plan_run_names[ph->run],
+	            ph->settle ? ", settling" : "");
+}
+
+static void phases_print(const struct phases* p, unsigned int started) {
+	printf("#Plan: %u of %u phases\n", started, p->plan->n);
+	for (unsigned int k = 0; k < started; k++) {
+		const struct plan_phase* ph = &p->plan->phase[k];
+		const struct phase_result* r = &p->result[k];
+		if (ph->settle)
+			continue;
+		printf("#  phase %u: vcc %ld mV, run %s: %" PRIu64 " samples, %.6f s, %.9f J, %.9f W, "
+		       "current mean %.1f nA, stddev %.1f nA, peak %" PRIu32 " nA\n",
+		       k + 1, ph->vcc, plan_run_names[ph->run], r->samples, r->seconds, r->joules,
+		       r->seconds > 0.0 ? r->joules / r->seconds : 0.0, r->mean, r->stddev, r->peak);
+	}
+}
+
+/*
+ * Current drive: fine drive measures small currents with a better
+ * resolution. The auto mode probes the workload with coarse drive
+ * first and switches to fine when its peak current stays in that range.
+ */
+enum {
+	CURRENT_DRIVE_PROBE_SECONDS = 1,
+	CURRENT_DRIVE_FINE_MAX_NA   = 1000000,  /* auto: highest peak for fine drive */
+};
+
+enum current_drive { CURRENT_DRIVE_COARSE, CURRENT_DRIVE_FINE, CURRENT_DRIVE_AUTO };
+
+/*
+ * Host clock model. Every sample callback pairs the device timestamp of
+ * the newest sample in it with the host clock on arrival. Arrival lags the
+ * sample by a positive and jittery USB and driver delay, so instead of a
+ * least-squares line the fit is the lower support line of the latest
+ * CLOCK_WINDOW pairs: the edge of their lower convex hull over the mean
+ * device time. Late callbacks can't pull it, and the window follows drift.
+ * Until the window spans CLOCK_MIN_SPAN_US the slope stays at 1.
+ */
+enum {
+	CLOCK_WINDOW      = 256,      /* callbacks */
+	CLOCK_MIN_SPAN_US = 1000000,
+};
+
+enum host_clock { HOST_CLOCK_MONOTONIC, HOST_CLOCK_REALTIME };
+static const char* const host_clock_names[] = { "monotonic", "realtime" };
+
+struct clock_sync {
+	int          clock;            /* enum host_clock */
+	uint64_t     x[CLOCK_WINDOW];  /* device timestamps, us */
+	uint64_t     y[CLOCK_WINDOW];  /* host arrival times, us */
+	unsigned int n, next;
+	uint64_t     x0, y0;           /* origin of the model */
+	double       slope;            /* host us per device us */
+	double       offset;           /* host time at x0, relative to y0 */
+	uint64_t     pairs, restarts;
+	uint64_t     out[ET_BLOCK_SAMPLES];
+};
+
+static void clock_init(struct clock_sync* c, int clock) {
+	memset(c, 0, sizeof(*c));
+	c->clock = clock;
+	c->slope = 1.0;
+}
+
+static uint64_t clock_now(const struct clock_sync* c) {
+	return c->clock == HOST_CLOCK_REALTIME ? host_wall_us() : host_time_us();
+}
+
+/* The window in time order, relative to the origin. */
+static unsigned int clock_window(const struct clock_sync* c, double* x, double* y) {
+	unsigned int first = (c->next + CLOCK_WINDOW - c->n) % CLOCK_WINDOW;
+	for (unsigned int i = 0; i < c->n; i++) {
+		unsigned int k = (first + i) % CLOCK_WINDOW;
+		x[i] = (double)(int64_t)(c->x[k] - c->x0);
+		y[i] = (double)(int64_t)(c->y[k] - c->y0);
+	}
+	return c->n;
+}
+
+static void clock_fit(struct clock_sync* c) {
+	double x[CLOCK_WINDOW], y[CLOCK_WINDOW], mean = 0.0;
+	unsigned int n = clock_window(c, x, y), hull[CLOCK_WINDOW], h = 0;
+
+	if (x[n - 1] - x[0] < CLOCK_MIN_SPAN_US) {
+		c->slope = 1.0;
+		c->offset = y[0] - x[0];
+		for (unsigned int i = 1; i < n; i++)
+			if (y[i] - x[i] < c->offset)
+				c->offset = y[i] - x[i];
+		return;
+	}
+	for (unsigned int i = 0; i < n; i++) {
+		while (h >= 2 && (x[hull[h - 1]] - x[hull[h - 2]]) * (y[i] - y[hull[h - 2]])
+		               - (y[hull[h - 1]] - y[hull[h - 2]]) * (x[i] - x[hull[h - 2]]) <= 0.0)
+			h--;
+		hull[h++] = i;
+		mean += x[i] / n;
+	}
+	unsigned int k = 0;
+	if (h < 2)
+		return;
+	while (k + 2 < h && x[hull[k + 1]] < mean)
+		k++;
+	c->slope = (y[hull[k + 1]] - y[hull[k]]) / (x[hull[k + 1]] - x[hull[k]]);
+	c->offset = y[hull[k]] - c->slope * x[hull[k]];
+}
+
+/* Add a callback's pair; a device timestamp going back (a reset) starts over. */
+static void clock_add(struct clock_sync* c, uint64_t device, uint64_t host) {
+	if (c->n > 0 && device <= c->x[(c->next + CLOCK_WINDOW - 1) % CLOCK_WINDOW]) {
+		c->n = 0;
+		c->restarts++;
+	}
+	if (c->n == 0) {
+		c->x0 = device;
+		c->y0 = host;
+	}
+	c->x[c->next] = device;
+	c->y[c->next] = host;
+	c->next = (c->next + 1) % CLOCK_WINDOW;
+	if (c->n < CLOCK_WINDOW)
+		c->n++;
+	c->pairs++;
+	clock_fit(c);
+}
+
+static void clock_map(struct clock_sync* c, const struct et_sample* s, uint32_t n) {
+	for (uint32_t i = 0; i < n; i++) {
+		double t = c->offset + c->slope * (double)(int64_t)(s[i].timestamp - c->x0);
+		c->out[i] = c->y0 + (uint64_t)(int64_t)llround(t);
+	}
+}
+
+static int double_cmp(const void* a, const void* b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+/* The drift, and how far the callbacks of the last window arrived after the fitted line. */
+static void clock_print(const struct clock_sync* c) {
+	double x[CLOCK_WINDOW], y[CLOCK_WINDOW];
+	unsigned int n = clock_window(c, x, y);
+	printf("#Host clock (%s): %" PRIu64 " callbacks, %" PRIu64 " restarts\n",
+	       host_clock_names[c->clock], c->pairs, c->restarts);
+	if (n < 2)
+		return;
+	for (unsigned int i = 0; i < n; i++)
+		y[i] -= c->offset + c->slope * x[i];
+	qsort(y, n, sizeof(*y), double_cmp);
+	printf("#  drift %+.3f ppm, callback delay over the fit: median %.0f us, p90 %.0f us, max %.0f us\n",
+	       (c->slope - 1.0) * 1e6, y[n / 2], y[n * 9 / 10], y[n - 1]);
+}
+
+/*
+ * Timeline markers: lines from other sources (the target's serial log, a
+ * control channel) arrive on other threads with a host clock time. They
+ * are queued and written by the sample callback, which maps them onto the
+ * device timeline through the host clock model. A marker is written after
+ * the block of samples it falls in, as '#marker TIMESTAMP SOURCE TEXT',
+ * and optionally into an index file with the energy counter at that point.
+ * Markers ahead of the latest sample wait for it.
+ */
+enum {
+	MARKER_QUEUE    = 1024,
+	MARKER_TEXT_MAX = 240,
+};
+
+struct marker {
+	uint64_t    host;    /* us on the clock model's host clock */
+	const char* source;
+	char        text[MARKER_TEXT_MAX];
+};
+
+struct markers {
+	mutex_t            lock;
+	struct marker      queue[MARKER_QUEUE];
+	unsigned int       head, count;
+	struct clock_sync* clock;
+	FILE*              index;    /* NULL if there is no index file */
+	uint32_t           energy;   /* counter at the latest sample */
+	uint64_t           written, dropped;
+};
+
+static int markers_init(struct markers* m, struct clock_sync* clock, const char* index_path) {
+	memset(m, 0, sizeof(*m));
+	m->clock = clock;
+	if (index_path) {
+		m->index = fopen(index_path, "w");
+		if (!m->index)
+			return -1;
+		fprintf(m->index, "timestamp,host_time,energy,source,text\n");
+	}
+	mutex_init(&m->lock);
+	return 0;
+}
+
+/* Queue a marker; control characters in the text become spaces. */
+static void markers_post(struct markers* m, uint64_t host, const char* source, const char* text) {
+	mutex_lock(&m->lock);
+	if (m->count == MARKER_QUEUE) {
+		m->dropped++;
+	} else {
+		struct marker* k = &m->queue[(m->head + m->count++) % MARKER_QUEUE];
+		k->host = host;
+		k->source = source;
+		snprintf(k->text, sizeof(k->text), "%s", text);
+		for (char* c = k->text; *c; c++)
+			if ((unsigned char)*c < ' ')
+				*c = ' ';
+	}
+	mutex_unlock(&m->lock);
+}
+
+/* Device timestamp of a host clock time, by the inverse of the clock model. */
+static uint64_t clock_unmap(const struct clock_sync* c, uint64_t host) {
+	return c->x0 + (uint64_t)(int64_t)llround(((double)(int64_t)(host - c->y0) - c->offset) / c->slope);
+}
+
+/* Write a CSV field quoted as in RFC 4180, so commas and quotes in log lines survive. */
+static void csv_quoted(FILE* f, const char* text) {
+	fputc('"', f);
+	for (const char* c = text; *c; c++) {
+		if (*c == '"')
+			fputc('"', f);
+		fputc(*c, f);
+	}
+	fputc('"', f);
+}
+
+static void markers_write(struct markers* m, struct sink* out, const struct marker* k, uint64_t t,
+                          uint32_t energy) {
+	sink_printf(out, "#marker %" PRIu64 " %s %s\n", t, k->source, k->text);
+	if (m->index) {
+		fprintf(m->index, "%" PRIu64 ",%" PRIu64 ",%" PRIu32 ",", t, k->host, energy);
+		csv_quoted(m->index, k->source);
+		fputc(',', m->index);
+		csv_quoted(m->index, k->text);
+		fputc('\n', m->index);
+	}
+	m->written++;
+}
+
+/* Write the markers up to the end of this block; with n == 0, all of them. */
+static void markers_add(struct markers* m, struct sink* out, const struct et_sample* s, uint32_t n) {
+	mutex_lock(&m->lock);
+	while (m->count > 0 && m->clock->pairs > 0) {
+		const struct marker* k = &m->queue[m->head];
+		uint64_t t = clock_unmap(m->clock, k->host);
+		if (n > 0 && t > s[n - 1].timestamp)
+			break;
+		for (uint32_t i = 0; i < n && s[i].timestamp <= t; i++)
+			m->energy = s[i].energy;
+		markers_write(m, out, k, t, m->energy);
+		m->head = (m->head + 1) % MARKER_QUEUE;
+		m->count--;
+	}
+	if (n > 0)
+		m->energy = s[n - 1].energy;
+	mutex_unlock(&m->lock);
+}
+
+static void markers_free(struct markers* m) {
+	if (m->index)
+		fclose(m->index);
+	mutex_destroy(&m->lock);
+}
+
+/*
+ * Line readers post each line of a text source as a marker, timed by the
+ * arrival of its first byte: the target's serial log (--serial), or a
+ * control channel that test scripts write step names to (--control), a
+ * FIFO or stdin.
+ */
+enum {
+	SERIAL_DEFAULT_BAUD = 115200,
+	LINE_POLL_MS        = 100,
+};
+
+struct line_reader {
+	char            path[256];
+	const char*     source;     /* marker source name */
+	struct markers* markers;
+#ifdef _WIN32
+	HANDLE          h;
+#else
+	int             fd;
+	int             keep_fd;    /* our own FIFO writer, so readers never see end of file */
+	bool            made_fifo;
+#endif
+	volatile bool   done;
+	thread_t        thread;
+	uint64_t        lines;
+};
+
+#ifdef _WIN32
+static int serial_open(struct line_reader* lr, unsigned long baud) {
+	char name[300];
+	DCB dcb = { 0 };
+	COMMTIMEOUTS to = { 0 };
+	snprintf(name, sizeof(name), "\\\\.\\%s", lr->path);
+	lr->h = CreateFileA(name, GENERIC_READ, 0, NULL, OPEN_EXISTING, 0, NULL);
+	if (lr->h == INVALID_HANDLE_VALUE)
+		return -1;
+	dcb.DCBlength = sizeof(dcb);
+	GetCommState(lr->h, &dcb);
+	dcb.BaudRate = baud;
+	dcb.ByteSize = 8;
+	dcb.Parity = NOPARITY;
+	dcb.StopBits = ONESTOPBIT;
+	to.ReadIntervalTimeout = MAXDWORD;
+	to.ReadTotalTimeoutMultiplier = MAXDWORD;
+	to.ReadTotalTimeoutConstant = LINE_POLL_MS;
+	if (!SetCommState(lr->h, &dcb) || !SetCommTimeouts(lr->h, &to)) {
+		CloseHandle(lr->h);
+		return -1;
+	}
+	return 0;
+}
+
+/* Only stdin; its blocking reads are cancelled when the reader stops. */
+static int control_open(struct line_reader* lr) {
+	if (strcmp(lr->path, "-") != 0) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	lr->h = GetStdHandle(STD_INPUT_HANDLE);
+	return lr->h == INVALID_HANDLE_VALUE ? -1 : 0;
+}
+
+/* Bytes read, 0 after a timeout without data, -1 at the end or on an error. */
+static int line_read(struct line_reader* lr, char* buf, int size) {
+	DWORD n;
+	if (!ReadFile(lr->h, buf, (DWORD)size, &n, NULL))
+		return -1;
+	return n > 0 || lr->h != GetStdHandle(STD_INPUT_HANDLE) ? (int)n : -1;
+}
+
+static void line_close(struct line_reader* lr) {
+	if (lr->h != GetStdHandle(STD_INPUT_HANDLE))
+		CloseHandle(lr->h);
+}
+#else
+static speed_t serial_speed(unsigned long baud) {
+	switch (baud) {
+	case 9600:   return B9600;
+	case 19200:  return B19200;
+	case 38400:  return B38400;
+	case 57600:  return B57600;
+	case 115200: return B115200;
+	case 230400: return B230400;
+#ifdef B460800
+	case 460800: return B460800;
+#endif
+#ifdef B921600
+	case 921600: return B921600;
+#endif
+	default:     return B0;
+	}
+}
+
+static int serial_open(struct line_reader* lr, unsigned long baud) {
+	struct termios tio;
+	speed_t speed = serial_speed(baud);
+	lr->keep_fd = -1;
+	if (speed == B0) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* Don't wait for carrier detect before CLOCAL is set; line_read polls anyway. */
+	lr->fd = open(lr->path, O_RDONLY | O_NOCTTY | O_NONBLOCK);
+	if (lr->fd < 0)
+		return -1;
+	if (tcgetattr(lr->fd, &tio) == 0) {
+		cfmakeraw(&tio);
+		cfsetispeed(&tio, speed);
+		cfsetospeed(&tio, speed);
+		tio.c_cflag |= CLOCAL | CREAD;
+		tcsetattr(lr->fd, TCSANOW, &tio);
+	}
+	return 0;
+}
+
+/* stdin, or a FIFO that is created if it doesn't exist yet. */
+static int control_open(struct line_reader* lr) {
+	lr->keep_fd = -1;
+	if (strcmp(lr->path, "-") == 0) {
+		lr->fd = STDIN_FILENO;
+		return 0;
+	}
+	if (mkfifo(lr->path, 0600) == 0)
+		lr->made_fifo = true;
+	else if (errno != EEXIST)
+		return -1;
+	lr->fd = open(lr->path, O_RDONLY | O_NONBLOCK);
+	if (lr->fd < 0)
+		return -1;
+	lr->keep_fd = open(lr->path, O_WRONLY | O_NONBLOCK);
+	return 0;
+}
+
+static int line_read(struct line_reader* lr, char* buf, int size) {
+	struct pollfd p = { lr->fd, POLLIN, 0 };
+	int r = poll(&p, 1, LINE_POLL_MS);
+	if (r <= 0)
+		return r < 0 && errno == EINTR ? 0 : r;
+	ssize_t n = read(lr->fd, buf, (size_t)size);
+	if (n < 0)
+		return errno == EINTR || errno == EAGAIN ? 0 : -1;
+	return n > 0 ? (int)n : -1;
+}
+
+static void line_close(struct line_reader* lr) {
+	if (lr->fd != STDIN_FILENO)
+		close(lr->fd);
+	if (lr->keep_fd >= 0)
+		close(lr->keep_fd);
+	if (lr->made_fifo)
+		unlink(lr->path);
+}
+#endif
+
+static void* line_reader_thread(void* arg) {
+	struct line_reader* lr = arg;
+	char buf[256], line[MARKER_TEXT_MAX];
+	size_t len = 0;
+	uint64_t start = 0;
+	while (!lr->done) {
+		int n = line_read(lr, buf, sizeof(buf));
+		if (n < 0)
+			break;
+		uint64_t now = clock_now(lr->markers->clock);
+		for (int i = 0; i < n; i++) {
+			if (buf[i] == '\r')
+				continue;
+			if (len == 0)
+				start = now;
+			if (buf[i] != '\n')
+				line[len++] = buf[i];
+			if (buf[i] == '\n' || len == sizeof(line) - 1) {
+				line[len] = '\0';
+				if (len > 0) {
+					markers_post(lr->markers, start, lr->source, line);
+					lr->lines++;
+				}
+				len = 0;
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Open a serial device, spec DEVICE[:BAUD], or a control channel, spec
+ * PATH or '-', and start posting its lines.
+ */
+static int line_reader_start(struct line_reader* lr, const char* source, const char* spec,
+                             struct markers* markers) {
+	memset(lr, 0, sizeof(*lr));
+	snprintf(lr->path, sizeof(lr->path), "%s", spec);
+	lr->source = source;
+	lr->markers = markers;
+	int rc;
+	if (strcmp(source, "serial") == 0) {
+		unsigned long baud = SERIAL_DEFAULT_BAUD;
+		char* colon = strrchr(lr->path, ':');
+		if (colon && colon[1] >= '0' && colon[1] <= '9') {
+			*colon = '\0';
+			baud = strtoul(colon + 1, NULL, 10);
+		}
+		rc = serial_open(lr, baud);
+	} else {
+		rc = control_open(lr);
+	}
+	if (rc != 0)
+		return -1;
+	if (thread_create(&lr->thread, line_reader_thread, lr) != 0) {
+		line_close(lr);
+		return -1;
+	}
+	return 0;
+}
+
+static void line_reader_stop(struct line_reader* lr) {
+	lr->done = true;
+#ifdef _WIN32
+	/* A cancel that lands before the reader enters ReadFile is lost, so repeat it. */
+	do
+		CancelSynchronousIo(lr->thread);
+	while (WaitForSingleObject(lr->thread, LINE_POLL_MS) == WAIT_TIMEOUT);
+#endif
+	thread_join(lr->thread);
+	line_close(lr);
+}
+
+struct capture {
+	struct sink     out;
+	mutex_t         lock;     /* serialises 'out' between the callbacks and main */
+	bool            no_samples;  /* don't write sample rows */
+	struct summary* summary;  /* running statistics, NULL if disabled */
+	struct histograms* hist;  /* current/power histograms, NULL if disabled */
+	struct psd*     psd;      /* current spectrum, NULL if disabled */
+	struct battery* battery;  /* battery life estimate, NULL if disabled */
+	struct autostop* autostop;  /* stop once energy per period is known, NULL if disabled */
+	struct region*  region;   /* breakpoint-delimited energy, NULL if disabled */
+	struct watch*   watch;    /* firmware variable reads, NULL if disabled */
+	struct phases*  phases;   /* plan phase tracking, NULL without a plan */
+	struct clock_sync* clock; /* host clock model, NULL if not needed */
+	bool            host_column;  /* write the host time of each sample */
+	struct markers* markers;  /* serial and control lines, NULL if disabled */
+	struct trigger* trigger;  /* only write windows around triggers, NULL if disabled */
+	struct segment_log* segments;  /* write segment rows instead, NULL if disabled */
+	struct didt*    didt;     /* energy-derived current column, NULL if disabled */
+	struct pyramid* pyramid;  /* downsampling pyramid, NULL if disabled */
+#ifndef _WIN32
+	struct bcast*   bcast;    /* live broadcast ring, NULL if disabled */
+#endif
+};
+
+/* Write a line to the output while EnergyTrace callbacks may be running. */
+static void capture_printf(struct capture* cap, const char* fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	mutex_lock(&cap->lock);
+	sink_vprintf(&cap->out, fmt, ap);
+	mutex_unlock(&cap->lock);
+	va_end(ap);
+}
+
+static void capture_block(struct capture* cap, const struct et_sample* s, uint32_t n) {
+	struct row_extras x = { NULL };
+	if (cap->didt) {
+		didt_run(cap->didt, s, n);
+		x.didt = cap->didt->out;
+	}
+	if (cap->host_column) {
+		clock_map(cap->clock, s, n);
+		x.host = cap->clock->out;
+	}
+	if (cap->segments) {
+		segmenter_add(&cap->segments->seg, s, n);
+		cap->segments->last_timestamp = s[n - 1].timestamp;
+	} else if (cap->trigger)
+		trigger_run(cap->trigger, &cap->out, s, n, &x);
+	else if (!cap->no_samples)
+		write_samples(&cap->out, s, n, &x);
+	if (cap->summary)
+		summary_add(cap->summary, s, n);
+	if (cap->phases)
+		summary_add(&cap->phases->summary, s, n);
+	if (cap->hist)
+		histograms_add(cap->hist, s, n);
+	if (cap->psd)
+		psd_add(cap->psd, s, n);
+	if (cap->battery)
+		battery_add(cap->battery, &cap->out, s, n);
+	if (cap->autostop)
+		autostop_add(cap->autostop, &cap->out, s, n);
+	if (cap->region)
+		region_add(cap->region, s, n);
+	if (cap->watch)
+		watch_add(cap->watch, &cap->out, s, n);
+	if (cap->markers)
+		markers_add(cap->markers, &cap->out, s, n);
+	if (cap->pyramid)
+		pyramid_add(cap->pyramid, s, n);
+#ifndef _WIN32
+	if (cap->bcast)
+		bcast_publish(cap->bcast, s, n);
+#endif
+}
+
+void push_cb(void* pContext, const uint8_t* pBuffer, uint32_t nBufferSize) {
+	struct capture* cap = pContext;
+	struct et_sample block[ET_BLOCK_SAMPLES];
+	uint32_t nblock = 0;
+
+	if (nBufferSize % ET_RECORD_SIZE != 0) {
+		fprintf(stderr, "Error: Unexpected EnergyTrace record length %u bytes.\n", nBufferSize);
+		return;
+	}
+
+	uint32_t n = nBufferSize / ET_RECORD_SIZE;
+	mutex_lock(&cap->lock);
+	if (cap->clock) {
+		/* Pair the arrival time with the newest sample before rows get written. */
+		uint64_t now = clock_now(cap->clock);
+		for (uint32_t i = n; i-- > 0;) {
+			const uint8_t* ev = pBuffer + (i * ET_RECORD_SIZE);
+			if (ev[0] == ET_EVENT_CURR_VOLT_ENERGY) {
+				clock_add(cap->clock, read_le_u56(ev + 1), now);
+				break;
+			}
+		}
+	}
+	for (uint32_t i = 0; i < n; i++) {
+		const uint8_t* ev = pBuffer + (i * ET_RECORD_SIZE);
+		if (ev[0] == ET_EVENT_CURR_VOLT_ENERGY) {
+			struct et_sample* s = &block[nblock];
+			s->timestamp = read_le_u56(ev + 1);
+			s->current = read_le_u32(ev + 8);
+			s->voltage = read_le_u16(ev + 12);
+			s->energy = read_le_u32(ev + 14);
+			if (cap->phases) {
+				if (phases_boundary(cap->phases, s)) {
+					if (nblock > 0)
+						capture_block(cap, block, nblock);
+					block[0] = *s;
+					s = &block[0];
+					nblock = 0;
+					phases_next(cap->phases, &cap->out);
+				}
+				if (!phases_accept(cap->phases, s))
+					continue;
+			}
+			if (++nblock == ET_BLOCK_SAMPLES) {
+				capture_block(cap, block, nblock);
+				nblock = 0;
+			}
+		}
+	}
+	if (nblock > 0)
+		capture_block(cap, block, nblock);
+	if (dump_requested && cap->hist) {
+		dump_requested = 0;
+		histograms_dump(&cap->out, cap->hist);
+	}
+	sink_flush_stale(&cap->out);
+	mutex_unlock(&cap->lock);
+}
+
+void error_cb(void* pContext, const char* pszErrorText) {
+	capture_printf(pContext, "error %s\n", pszErrorText);
+}
+
+void usage(char *a0) {
+	printf("usage: %s [options] <seconds> [port]\n", a0);
+	printf("       %s [options] --plan=FILE [port]\n", a0);
+	printf("  seconds  Measurement duration\n");
+	printf("  FILE     Phases to run, one per line: vcc=MV run=free|jtag|halt\n");
+	printf("           seconds=S|samples=N reset=yes|no\n");
+	printf("  port     Interface port (default: TIUSB)\n");
+	printf("           Examples: TIUSB, USB, COM3, COM4\n");
+	printf("options:\n");
+	printf("  --writer=KIND  Sample writer: auto, uring, threads, stdio (default: auto)\n");
+	printf("  --didt[=fir:N|iir:A]\n");
+	printf("                 Add a column with the current derived from the energy counter,\n");
+	printf("                 low-pass filtered by an N-tap FIR (default fir:%d) or a\n", DIDT_DEFAULT_TAPS);
+	printf("                 one-pole IIR with coefficient 0 < A <= 1\n");
+	printf("  --host-time[=realtime|monotonic]\n");
+	printf("                 Add a column with the host clock time of each sample, in us\n");
+	printf("                 (default: realtime, since the Unix epoch)\n");
+	printf("  --summary      Print running statistics (mean, quantiles, energy) at the end\n");
+	printf("  --no-samples   Don't write sample rows\n");
+#ifdef _WIN32
+	printf("  --histogram    Write log-bucketed current and power histograms at the end\n");
+#else
+	printf("  --histogram    Write log-bucketed current and power histograms at the end\n");
+	printf("                 (and whenever SIGUSR1 is received)\n");
+#endif
+	printf("  --psd[=N]      Write the Welch power spectral density of the current at the end,\n");
+	printf("                 from N-point frames (default: %d)\n", PSD_DEFAULT_N);
+	printf("  --battery=MAH[:PCT]\n");
+	printf("                 Project the battery life for a cell of MAH mAh losing PCT %% per\n");
+	printf("                 year to self-discharge, updated live\n");
+	printf("  --battery-stop[=PCT]\n");
+	printf("                 Stop once the projection has settled within PCT %% (default: %g)\n",
+	       BATTERY_DEFAULT_CONVERGE);
+	printf("  --auto-stop[=PCT]\n");
+	printf("                 Detect the workload period and stop once the energy per period\n");
+	printf("                 is known within PCT %% (default: %g); seconds is then a limit\n",
+	       AUTOSTOP_DEFAULT_TARGET);
+	printf("  --region=START:STOP\n");
+	printf("                 Measure the energy between EEM breakpoints on two code addresses\n");
+	printf("  --iterations=N Region iterations to measure (default: %d); seconds is a limit\n",
+	       REGION_DEFAULT_ITERATIONS);
+	printf("  --cycles       Also count CPU cycles per region iteration and report nJ/cycle\n");
+	printf("  --current-drive=coarse|fine|auto[:NA]\n");
+	printf("                 EnergyTrace current drive; auto picks fine after a %d s probe\n",
+	       CURRENT_DRIVE_PROBE_SECONDS);
+	printf("                 when the peak stays below NA (default: %d)\n", CURRENT_DRIVE_FINE_MAX_NA);
+	printf("  --sweep[=STEP[:SETTLE]]\n");
+	printf("                 Capture for seconds at every STEP mV (default: %d) across the\n",
+	       SWEEP_DEFAULT_STEP);
+	printf("                 device's supply range, after SETTLE ms (default: %d) at each\n",
+	       SWEEP_DEFAULT_SETTLE_MS);
+	printf("  --serial=DEVICE[:BAUD]\n");
+	printf("                 Interleave lines from the target's UART as markers (default: %d baud)\n",
+	       SERIAL_DEFAULT_BAUD);
+	printf("  --control=FIFO|-\n");
+	printf("                 Interleave lines written to FIFO (created if needed) or stdin as\n");
+	printf("                 markers\n");
+	printf("  --marker-index=FILE\n");
+	printf("                 Also list the markers in FILE, with the energy counter at each\n");
+	printf("  --watch=ADDR[:BYTES][,...]\n");
+	printf("                 Poll firmware variables (2 bytes by default) and report the\n");
+	printf("                 energy per increment\n");
+	printf("  --watch-interval=MS\n");
+	printf("                 Time between variable reads (default: %d)\n", WATCH_DEFAULT_INTERVAL_MS);
+	printf("  --trigger=LEVEL\n");
+	printf("                 Only write windows around crossings of LEVEL nA, like a scope\n");
+	printf("  --trigger-edge=rising|falling\n");
+	printf("  --trigger-pre=N, --trigger-post=N\n");
+	printf("                 Samples kept before / after the crossing (default: %d / %d)\n",
+	       TRIGGER_DEFAULT_PRE, TRIGGER_DEFAULT_POST);
+	printf("  --trigger-holdoff=N\n");
+	printf("                 Samples to ignore after a window (default: 0)\n");
+	printf("  --trigger-single\n");
+	printf("                 Stop after the first window\n");
+	printf("  --segments=LOW:HIGH\n");
+	printf("                 Write one row per sleep/active segment instead of the samples;\n");
+	printf("                 active starts at HIGH nA and ends below LOW nA\n");
+	printf("  --pyramid=PREFIX\n");
+	printf("                 Write min/max/mean buckets of 10^k samples to PREFIX.k\n");
+#ifndef _WIN32
+	printf("  --shm=NAME     Also publish samples to POSIX shared memory NAME\n");
+	printf("  --serve=PATH   Serve live samples to clients on Unix socket PATH\n");
+	printf("       %s shm-read <name>\n", a0);
+	printf("                 Print the samples published by a running capture\n");
+#endif
+	printf("       %s pyramid-view <prefix> [width [t0_us t1_us]]\n", a0);
+	printf("                 Print about 'width' pyramid buckets covering t0..t1\n");
+	printf("       %s cluster [--segments=LOW:HIGH] <capture> [k]\n", a0);
+	printf("                 Group the bursts of a saved capture by energy signature\n");
+	printf("       %s match <capture> <template> [threshold]\n", a0);
+	printf("                 Find the occurrences of a template trace in a saved capture\n");
+	printf("       %s changepoints [--min-length=N] <capture> [penalty]\n", a0);
+	printf("                 Split a saved capture into phases of constant mean current\n");
+}
+
+struct options {
+	unsigned int   duration;
+	const char*    port;
+	enum sink_kind writer;
+	const char*    didt_spec;
+	int            host_clock;      /* enum host_clock, -1 if disabled */
+	const char*    pyramid_prefix;
+	bool           summary;
+	bool           no_samples;
+	bool           histogram;
+	uint32_t       psd;       /* FFT length, 0 if disabled */
+	double         battery_capacity;  /* mAh, 0 if disabled */
+	double         battery_self_discharge;
+	double         battery_converge;  /* 0 to run for the full duration */
+	double         autostop;          /* relative CI half-width, 0 if disabled */
+	bool           region;
+	uint32_t       region_start, region_stop;
+	unsigned int   iterations;
+	bool           cycles;
+	const char*    watch_spec;
+	const char*    plan_path;
+	const char*    serial_spec;
+	const char*    control_path;
+	const char*    marker_index;
+	int            current_drive;   /* enum current_drive, -1 to leave it alone */
+	uint32_t       fine_max;        /* nA */
+	long           sweep_step;      /* mV, 0 if disabled */
+	double         sweep_settle;    /* ms */
+	unsigned int   watch_interval;  /* ms */
+	const char*    trigger_level;
+	bool           trigger_falling;
+	bool           trigger_single;
+	uint32_t       trigger_pre, trigger_post, trigger_holdoff;
+	bool           segments;
+	uint32_t       segment_low, segment_high;
+	const char*    shm_name;
+	const char*    serve_path;
+};
+
+/* Returns the value of "--name=value", "" for a bare "--name", or NULL if arg is not that option. */
+static const char* option_value(const char* arg, const char* name) {
+	size_t n = strlen(name);
+	if (strncmp(arg, "--", 2) != 0 || strncmp(arg + 2, name, n) != 0)
+		return NULL;
+	if (arg[2 + n] == '\0')
+		return "";
+	if (arg[2 + n] == '=')
+		return arg + 3 + n;
+	return NULL;
+}
+
+static int lookup_name(const char* const* names, int count, const char* name) {
+	for (int i = 0; i < count; i++)
+		if (strcmp(names[i], name) == 0)
+			return i;
+	return -1;
+}
+
+static int parse_args(int argc, char* argv[], struct options* o) {
+	const char* pos[2];
+	int npos = 0;
+
+	for (int i = 1; i < argc; i++) {
+		const char* a = argv[i];
+		const char* v;
+		if (strncmp(a, "--", 2) != 0) {
+			if (npos == 2)
+				return -1;
+			pos[npos++] = a;
+		} else if ((v = option_value(a, "writer"))) {
+			int k = lookup_name(sink_kind_names, 4, v);
+			if (k < 0) {
+				fprintf(stderr, "Error: unknown writer '%s'.\n", v);
+				return -1;
+			}
+			o->writer = (enum sink_kind)k;
+		} else if ((v = option_value(a, "didt"))) {
+			o->didt_spec = v;
+		} else if ((v = option_value(a, "host-time"))) {
+			o->host_clock = *v ? lookup_name(host_clock_names, 2, v) : HOST_CLOCK_REALTIME;
+			if (o->host_clock < 0) {
+				fprintf(stderr, "Error: --host-time expects realtime or monotonic.\n");
+				return -1;
+			}
+		} else if ((v = option_value(a, "summary")) && !*v) {
+			o->summary = true;
+		} else if ((v = option_value(a, "no-samples")) && !*v) {
+			o->no_samples = true;
+		} else if ((v = option_value(a, "histogram")) && !*v) {
+			o->histogram = true;
+		} else if ((v = option_value(a, "battery")) && *v) {
+			if (parse_battery(v, &o->battery_capacity, &o->battery_self_discharge) != 0) {
+				fprintf(stderr, "Error: --battery expects MAH[:PERCENT_PER_YEAR].\n");
+				return -1;
+			}
+		} else if ((v = option_value(a, "battery-stop"))) {
+			o->battery_converge = (*v ? strtod(v, NULL) : BATTERY_DEFAULT_CONVERGE) / 100.0;
+			if (!(o->battery_converge > 0.0)) {
+				fprintf(stderr, "Error: --battery-stop expects a positive percentage.\n");
+				return -1;
+			}
+		} else if ((v = option_value(a, "region")) && *v) {
+			char* end;
+			o->region_start = (uint32_t)strtoul(v, &end, 0);
+			if (*end == ':')
+				o->region_stop = (uint32_t)strtoul(end + 1, &end, 0);
+			if (*end != '\0' || v[0] == ':') {
+				fprintf(stderr, "Error: --region expects START:STOP code addresses.\n");
+				return -1;
+			}
+			o->region = true;
+		} else if ((v = option_value(a, "iterations")) && *v) {
+			o->iterations = (unsigned int)strtoul(v, NULL, 0);
+			if (o->iterations == 0) {
+				fprintf(stderr, "Error: --iterations expects a positive count.\n");
+				return -1;
+			}
+		} else if ((v = option_value(a, "cycles")) && !*v) {
+			o->cycles = true;
+		} else if ((v = option_value(a, "plan")) && *v) {
+			o->plan_path = v;
+		} else if ((v = option_value(a, "current-drive")) && *v) {
+			o->current_drive = -1;
+			if (strcmp(v, "coarse") == 0)
+				o->current_drive = CURRENT_DRIVE_COARSE;
+			else if (strcmp(v, "fine") == 0)
+				o->current_drive = CURRENT_DRIVE_FINE;
+			else if (strncmp(v, "auto", 4) == 0 && (v[4] == '\0' || v[4] == ':'))
+				o->current_drive = CURRENT_DRIVE_AUTO;
+			if (o->current_drive == CURRENT_DRIVE_AUTO && v[4] == ':')
+				o->fine_max = (uint32_t)strtoul(v + 5, NULL, 0);
+			if (o->current_drive < 0 || o->fine_max == 0) {
+				fprintf(stderr, "Error: --current-drive expects coarse, fine or auto[:NA].\n");
+				return -1;
+			}
+		} else if ((v = option_value(a, "sweep"))) {
+			char* end;
+			o->sweep_step = *v ? strtol(v, &end, 0) : SWEEP_DEFAULT_STEP;
+			o->sweep_settle = SWEEP_DEFAULT_SETTLE_MS;
+			if (*v && *end == ':')
+				o->sweep_settle = strtod(end + 1, &end);
+			if (o->sweep_step <= 0 || o->sweep_settle < 0.0 || (*v && *end != '\0')) {
+				fprintf(stderr, "Error: --sweep expects STEP[:SETTLE] in mV and ms.\n");
+				return -1;
+			}
+		} else if ((v = option_value(a, "serial")) && *v) {
+			o->serial_spec = v;
+		} else if ((v = option_value(a, "control")) && *v) {
+			o->control_path = v;
+		} else if ((v = option_value(a, "marker-index")) && *v) {
+			o->marker_index = v;
+		} else if ((v = option_value(a, "watch")) && *v) {
+			o->watch_spec = v;
+		} else if ((v = option_value(a, "watch-interval")) && *v) {
+			o->watch_interval = (unsigned int)strtoul(v, NULL, 0);
+			if (o->watch_interval == 0) {
+				fprintf(stderr, "Error: --watch-interval expects a positive number of ms.\n");
+				return -1;
+			}
+		} else if ((v = option_value(a, "auto-stop"))) {
+			o->autostop = (*v ? strtod(v, NULL) : AUTOSTOP_DEFAULT_TARGET) / 100.0;
+			if (!(o->autostop > 0.0)) {
+				fprintf(stderr, "Error: --auto-stop expects a positive percentage.\n");
+				return -1;
+			}
+		} else if ((v = option_value(a, "psd"))) {
+			o->psd = *v ? (uint32_t)strtoul(v, NULL, 0) : PSD_DEFAULT_N;
+			if (o->psd < PSD_MIN_N || o->psd > PSD_MAX_N || (o->psd & (o->psd - 1)) != 0) {
+				fprintf(stderr, "Error: --psd expects a power of two from %d to %d.\n", PSD_MIN_N, PSD_MAX_N);
+				return -1;
+			}
+		} else if ((v = option_value(a, "trigger")) && *v) {
+			o->trigger_level = v;
+		} else if ((v = option_value(a, "trigger-edge")) && *v) {
+			if (strcmp(v, "rising") != 0 && strcmp(v, "falling") != 0) {
+				fprintf(stderr, "Error: unknown trigger edge '%s'.\n", v);
+				return -1;
+			}
+			o->trigger_falling = strcmp(v, "falling") == 0;
+		} else if ((v = option_value(a, "trigger-pre")) && *v) {
+			o->trigger_pre = (uint32_t)strtoul(v, NULL, 0);
+		} else if ((v = option_value(a, "trigger-post")) && *v) {
+			o->trigger_post = (uint32_t)strtoul(v, NULL, 0);
+		} else if ((v = option_value(a, "trigger-holdoff")) && *v) {
+			o->trigger_holdoff = (uint32_t)strtoul(v, NULL, 0);
+		} else if ((v = option_value(a, "trigger-single")) && !*v) {
+			o->trigger_single = true;
+		} else if ((v = option_value(a, "segments")) && *v) {
+			if (parse_thresholds(v, &o->segment_low, &o->segment_high) != 0) {
+				fprintf(stderr, "Error: --segments expects LOW:HIGH with LOW <= HIGH.\n");
+				return -1;
+			}
+			o->segments = true;
+		} else if ((v = option_value(a, "pyramid")) && *v) {
+			o->pyramid_prefix = v;
+#ifndef _WIN32
+		} else if ((v = option_value(a, "shm")) && *v) {
+			o->shm_name = v;
+		} else if ((v = option_value(a, "serve")) && *v) {
+			o->serve_path = v;
+#endif
+		} else {
+			fprintf(stderr, "Error: unknown option '%s'.\n", a);
+			return -1;
+		}
+	}
+
+	/* Segment rows replace the sample rows these options shape. */
+	if (o->segments && (o->trigger_level || o->didt_spec || o->host_clock >= 0)) {
+		fprintf(stderr, "Error: --segments can't be combined with --trigger, --didt or --host-time.\n");
+		return -1;
+	}
+
+	if (o->plan_path) {
+		if (npos > 1)
+			return -1;
+		o->port = (npos >= 1) ? pos[0] : "TIUSB";
+		return 0;
+	}
+	if (npos < 1)
+		return -1;
+	o->duration = strtod(pos[0], 0);
+	if (o->duration == 0)
+		return -1;
+	o->port = (npos >= 2) ? pos[1] : "TIUSB";
+	return 0;
+}
+
+/*
+ * Offline analysis helpers: loading a capture written by energytrace and
+ * running work on all cores.
+ */
+struct capture_file {
+	struct et_sample* s;
+	size_t            n;
+	size_t            cap;
+};
+
+/* Read the sample rows of a capture; '#' lines and other row types are skipped. */
+static int load_capture(const char* path, struct capture_file* f) {
+	FILE* in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	char line[256];
+	memset(f, 0, sizeof(*f));
+	if (!in) {
+		fprintf(stderr, "Error: Could not open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	while (fgets(line, sizeof(line), in)) {
+		uint64_t v[4];
+		char* p = line;
+		int k;
+		if (line[0] < '0' || line[0] > '9')
+			continue;
+		for (k = 0; k < 4; k++) {
+			char* end;
+			v[k] = strtoull(p, &end, 10);
+			if (end == p || (k < 3 && *end != ','))
+				break;
+			p = end + 1;
+		}
+		if (k < 4)
+			continue;
+		if (f->n == f->cap) {
+			size_t cap = f->cap ? 2 * f->cap : 65536;
+			struct et_sample* s = realloc(f->s, cap * sizeof(*s));
+			if (!s) {
+				fprintf(stderr, "Error: Out of memory reading %s.\n", path);
+				break;
+			}
+			f->s = s;
+			f->cap = cap;
+		}
+		struct et_sample* s = &f->s[f->n++];
+		s->timestamp = v[0];
+		s->current = (uint32_t)v[1];
+		s->voltage = (uint32_t)v[2];
+		s->energy = (uint32_t)v[3];
+	}
+	if (in != stdin)
+		fclose(in);
+	if (f->n == 0) {
+		fprintf(stderr, "Error: No samples in %s.\n", path);
+		free(f->s);
+		return -1;
+	}
+	return 0;
+}
+
+static int cpu_count(void) {
+#ifdef _WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return si.dwNumberOfProcessors > 0 ? (int)si.dwNumberOfProcessors : 1;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+#endif
+}
+
+enum { PARALLEL_MAX_THREADS = 64 };
+
+struct parallel_job {
+	void (*fn)(void* arg, int part, int parts);
+	void* arg;
+	int   part, parts;
+};
+
+static void* parallel_thread(void* p) {
+	struct parallel_job* j = p;
+	j->fn(j->arg, j->part, j->parts);
+	return NULL;
+}
+
+/* Run fn(arg, part, parts) for every part on its own thread and wait for all. */
+static void parallel_for(int parts, void (*fn)(void* arg, int part, int parts), void* arg) {
+	struct parallel_job jobs[PARALLEL_MAX_THREADS];
+	thread_t threads[PARALLEL_MAX_THREADS];
+	bool started[PARALLEL_MAX_THREADS];
+	if (parts > PARALLEL_MAX_THREADS)
+		parts = PARALLEL_MAX_THREADS;
+	for (int i = 0; i < parts; i++) {
+		jobs[i] = (struct parallel_job){ fn, arg, i, parts };
+		started[i] = i > 0 && thread_create(&threads[i], parallel_thread, &jobs[i]) == 0;
+	}
+	fn(arg, 0, parts);
+	for (int i = 1; i < parts; i++) {
+		if (started[i])
+			thread_join(threads[i]);
+		else
+			fn(arg, i, parts);
+	}
+}
+
+/*
+ * Burst clustering ("energytrace cluster"): every active segment of a
+ * capture becomes a feature vector (log duration, log energy, log peak,
+ * log mean current, time-to-peak, energy centroid and fraction of the
+ * burst above half its peak), standardized and grouped with k-means. The
+ * assignment step runs on all cores. The report lists, per cluster, how
+ * often it occurs and its share of the capture's energy, plus the
+ * resampled current waveform of the burst closest to each centroid.
+ */
+enum {
+	BURST_FEATURES     = 7,
+	CLUSTER_MAX_K      = 16,
+	CLUSTER_AUTO_MAX_K = 8,
+	CLUSTER_ITERATIONS = 100,
+	CLUSTER_MIN_FLOOR  = 100,  /* nA, so a zero median still gives thresholds */
+	EXEMPLAR_POINTS    = 32,
+};
+
+struct burst {
+	size_t   first, last;   /* sample indices, inclusive */
+	uint64_t start, duration;
+	uint64_t energy;
+	uint32_t peak, mean;
+	double   f[BURST_FEATURES];
+	int      cluster;
+};
+
+struct burst_list {
+	const struct capture_file* cf;
+	struct burst*              b;
+	size_t                     n, cap;
+	size_t                     next_sample;  /* search hint for segment start */
+	uint64_t                   total_energy;
+};
+
+static void burst_collect(void* ctx, const struct segment* seg) {
+	struct burst_list* l = ctx;
+	const struct capture_file* cf = l->cf;
+	size_t i = l->next_sample;
+
+	l->total_energy += seg->energy;
+	while (i < cf->n && cf->s[i].timestamp < seg->start)
+		i++;
+	size_t first = i;
+	while (i < cf->n && cf->s[i].timestamp < seg->start + seg->duration)
+		i++;
+	l->next_sample = i;
+	if (!seg->active || i == first)
+		return;
+
+	if (l->n == l->cap) {
+		size_t cap = l->cap ? 2 * l->cap : 1024;
+		struct burst* b = realloc(l->b, cap * sizeof(*b));
+		if (!b)
+			return;
+		l->b = b;
+		l->cap = cap;
+	}
+	struct burst* b = &l->b[l->n++];
+	memset(b, 0, sizeof(*b));
+	b->first = first;
+	b->last = i - 1;
+	b->start = seg->start;
+	b->duration = seg->duration;
+	b->energy = seg->energy;
+	b->peak = seg->peak;
+	b->mean = seg->mean;
+}
+
+static void burst_features(const struct capture_file* cf, struct burst* b) {
+	const struct et_sample* s = cf->s;
+	double sum = 0.0, moment = 0.0;
+	size_t n = b->last - b->first + 1, above = 0, peak_at = b->first;
+	for (size_t i = b->first; i <= b->last; i++) {
+		double pos = n > 1 ? (double)(i - b->first) / (double)(n - 1) : 0.0;
+		sum += s[i].current;
+		moment += s[i].current * pos;
+		if (s[i].current >= b->peak / 2)
+			above++;
+		if (s[i].current == b->peak && peak_at == b->first)
+			peak_at = i;
+	}
+	b->f[0] = log1p((double)b->duration);
+	b->f[1] = log1p((double)b->energy);
+	b->f[2] = log1p((double)b->peak);
+	b->f[3] = log1p((double)b->mean);
+	b->f[4] = n > 1 ? (double)(peak_at - b->first) / (double)(n - 1) : 0.0;
+	b->f[5] = sum > 0.0 ? moment / sum : 0.0;
+	b->f[6] = (double)above / (double)n;
+}
+
+struct kmeans {
+	struct burst* b;
+	size_t        n;
+	int           k;
+	double        c[CLUSTER_MAX_K][BURST_FEATURES];
+	/* per-thread partial results of the assignment step */
+	double        sum[PARALLEL_MAX_THREADS][CLUSTER_MAX_K][BURST_FEATURES];
+	size_t        count[PARALLEL_MAX_THREADS][CLUSTER_MAX_K];
+	double        sse[PARALLEL_MAX_THREADS];
+	size_t        changed[PARALLEL_MAX_THREADS];
+};
+
+static double feature_dist2(const double* a, const double* b) {
+	double d = 0.0;
+	for (int j = 0; j < BURST_FEATURES; j++)
+		d += (a[j] - b[j]) * (a[j] - b[j]);
+	return d;
+}
+
+static void kmeans_assign(void* arg, int part, int parts) {
+	struct kmeans* km = arg;
+	size_t from = km->n * part / parts, to = km->n * (part + 1) / parts;
+	memset(km->sum[part], 0, sizeof(km->sum[part]));
+	memset(km->count[part], 0, sizeof(km->count[part]));
+	km->sse[part] = 0.0;
+	km->changed[part] = 0;
+	for (size_t i = from; i < to; i++) {
+		struct burst* b = &km->b[i];
+		int best = 0;
+		double best_d = feature_dist2(b->f, km->c[0]);
+		for (int c = 1; c < km->k; c++) {
+			double d = feature_dist2(b->f, km->c[c]);
+			if (d < best_d) {
+				best_d = d;
+				best = c;
+			}
+		}
+		if (b->cluster != best)
+			km->changed[part]++;
+		b->cluster = best;
+		km->sse[part] += best_d;
+		km->count[part][best]++;
+		for (int j = 0; j < BURST_FEATURES; j++)
+			km->sum[part][best][j] += b->f[j];
+	}
+}
+
+/* k-means with k-means++ seeding (fixed seed, so runs are repeatable); returns the SSE. */
+static double kmeans_run(struct kmeans* km, int threads) {
+	uint64_t rng = 0x9e3779b97f4a7c15ull;
+	double* d2 = malloc(km->n * sizeof(double));
+	if (!d2)
+		return INFINITY;
+
+	memcpy(km->c[0], km->b[0].f, sizeof(km->c[0]));
+	for (int c = 1; c < km->k; c++) {
+		double total = 0.0;
+		for (size_t i = 0; i < km->n; i++) {
+			double best = INFINITY;
+			for (int j = 0; j < c; j++) {
+				double d = feature_dist2(km->b[i].f, km->c[j]);
+				if (d < best)
+					best = d;
+			}
+			d2[i] = best;
+			total += best;
+		}
+		rng ^= rng << 13;
+		rng ^= rng >> 7;
+		rng ^= rng << 17;
+		double pick = (double)(rng >> 11) / 9007199254740992.0 * total;
+		size_t i = 0;
+		while (i + 1 < km->n && (pick -= d2[i]) > 0.0)
+			i++;
+		memcpy(km->c[c], km->b[i].f, sizeof(km->c[c]));
+	}
+	free(d2);
+
+	for (size_t i = 0; i < km->n; i++)
+		km->b[i].cluster = -1;
+
+	double sse = 0.0;
+	for (int it = 0; it < CLUSTER_ITERATIONS; it++) {
+		parallel_for(threads, kmeans_assign, km);
+		size_t changed = 0;
+		sse = 0.0;
+		for (int c = 0; c < km->k; c++) {
+			double sum[BURST_FEATURES] = { 0 };
+			size_t count = 0;
+			for (int t = 0; t < threads; t++) {
+				count += km->count[t][c];
+				for (int j = 0; j < BURST_FEATURES; j++)
+					sum[j] += km->sum[t][c][j];
+			}
+			if (count > 0)
+				for (int j = 0; j < BURST_FEATURES; j++)
+					km->c[c][j] = sum[j] / (double)count;
+		}
+		for (int t = 0; t < threads; t++) {
+			changed += km->changed[t];
+			sse += km->sse[t];
+		}
+		if (changed == 0)
+			break;
+	}
+	return sse;
+}
+
+static int cluster_main(int argc, char* argv[]) {
+	const char* path = NULL;
+	int k = 0;
+	uint32_t low = 0, high = 0;
+	bool thresholds = false;
+
+	for (int i = 1; i < argc; i++) {
+		const char* v;
+		if ((v = option_value(argv[i], "segments")) && *v) {
+			if (parse_thresholds(v, &low, &high) != 0) {
+				fprintf(stderr, "Error: --segments expects LOW:HIGH with LOW <= HIGH.\n");
+				return 1;
+			}
+			thresholds = true;
+		} else if (!path) {
+			path = argv[i];
+		} else {
+			k = atoi(argv[i]);
+		}
+	}
+	if (!path || k < 0 || k > CLUSTER_MAX_K) {
+		printf("usage: energytrace cluster [--segments=LOW:HIGH] <capture> [k]\n");
+		printf("  k  number of clusters, 1..%d (default: chosen automatically)\n", CLUSTER_MAX_K);
+		return 1;
+	}
+
+	struct capture_file cf;
+	if (load_capture(path, &cf) != 0)
+		return 1;
+
+	if (!thresholds) {
+		/* Mostly-asleep firmware: the median is the sleep floor. */
+		static struct tdigest td;
+		tdigest_init(&td);
+		for (size_t i = 0; i < cf.n; i++)
+			tdigest_add(&td, cf.s[i].current);
+		double floor_na = tdigest_quantile(&td, 0.5);
+		if (floor_na < CLUSTER_MIN_FLOOR)
+			floor_na = CLUSTER_MIN_FLOOR;
+		low = (uint32_t)(5.0 * floor_na);
+		high = (uint32_t)(10.0 * floor_na);
+	}
+	printf("#%zu samples, bursts from %" PRIu32 " nA down to %" PRIu32 " nA\n", cf.n, high, low);
+
+	struct burst_list bl = { .cf = &cf };
+	struct segmenter seg;
+	segmenter_init(&seg, low, high, burst_collect, &bl);
+	for (size_t i = 0; i < cf.n; i += ET_BLOCK_SAMPLES) {
+		size_t m = cf.n - i < ET_BLOCK_SAMPLES ? cf.n - i : ET_BLOCK_SAMPLES;
+		segmenter_add(&seg, cf.s + i, (uint32_t)m);
+	}
+	segmenter_finish(&seg, cf.s[cf.n - 1].timestamp);
+	if (bl.n == 0) {
+		printf("#No bursts found.\n");
+		free(cf.s);
+		return 0;
+	}
+
+	/* Standardize the features so that none dominates the distance. */
+	for (size_t i = 0; i < bl.n; i++)
+		burst_features(&cf, &bl.b[i]);
+	for (int j = 0; j < BURST_FEATURES; j++) {
+		double mean = 0.0, m2 = 0.0;
+		for (size_t i = 0; i < bl.n; i++) {
+			double d = bl.b[i].f[j] - mean;
+			mean += d / (double)(i + 1);
+			m2 += d * (bl.b[i].f[j] - mean);
+		}
+		double sd = bl.n > 1 ? sqrt(m2 / (double)(bl.n - 1)) : 0.0;
+		for (size_t i = 0; i < bl.n; i++)
+			bl.b[i].f[j] = sd > 0.0 ? (bl.b[i].f[j] - mean) / sd : 0.0;
+	}
+
+	int threads = cpu_count();
+	static struct kmeans km;
+	km.b = bl.b;
+	km.n = bl.n;
+	if (threads > PARALLEL_MAX_THREADS)
+		threads = PARALLEL_MAX_THREADS;
+	if ((size_t)threads > bl.n)
+		threads = (int)bl.n;
+
+	if (k == 0) {
+		/* Pick k by a BIC-style score: fit versus number of parameters. */
+		double best = INFINITY;
+		int maxk = bl.n < CLUSTER_AUTO_MAX_K ? (int)bl.n : CLUSTER_AUTO_MAX_K;
+		for (int kk = 1; kk <= maxk; kk++) {
+			km.k = kk;
+			double sse = kmeans_run(&km, threads);
+			double score = bl.n * log(sse / bl.n + 1e-9) + kk * BURST_FEATURES * log((double)bl.n);
+			if (score < best) {
+				best = score;
+				k = kk;
+			}
+		}
+	}
+	km.k = k < (int)bl.n ? k : (int)bl.n;
+	kmeans_run(&km, threads);
+
+	uint64_t total = bl.total_energy, burst_energy = 0;
+	double seconds = (cf.s[cf.n - 1].timestamp - cf.s[0].timestamp) / 1e6;
+	printf("#%zu bursts in %.3f s, %d clusters, %d threads\n", bl.n, seconds, km.k, threads);
+	printf("#cluster,bursts,rate_hz,mean_duration_us,mean_energy_J,mean_peak_nA,total_energy_J,energy_share\n");
+	size_t exemplar[CLUSTER_MAX_K];
+	for (int c = 0; c < km.k; c++) {
+		size_t count = 0;
+		uint64_t duration = 0, energy = 0, peak = 0;
+		double best = INFINITY;
+		exemplar[c] = 0;
+		for (size_t i = 0; i < bl.n; i++) {
+			struct burst* b = &bl.b[i];
+			if (b->cluster != c)
+				continue;
+			count++;
+			duration += b->duration;
+			energy += b->energy;
+			peak += b->peak;
+			double d = feature_dist2(b->f, km.c[c]);
+			if (d < best) {
+				best = d;
+				exemplar[c] = i;
+			}
+		}
+		burst_energy += energy;
+		if (count == 0)
+			continue;
+		printf("%d,%zu,%.4f,%.1f,%.9f,%.0f,%.9f,%.4f\n", c, count,
+		       seconds > 0.0 ? count / seconds : 0.0, (double)duration / count,
+		       energy * (ET_ENERGY_NJ * 1e-9) / count, (double)peak / count,
+		       energy * (ET_ENERGY_NJ * 1e-9), total ? (double)energy / total : 0.0);
+	}
+	printf("between,-,-,-,-,-,%.9f,%.4f\n", (total - burst_energy) * (ET_ENERGY_NJ * 1e-9),
+	       total ? (double)(total - burst_energy) / total : 0.0);
+
+	printf("#exemplar waveforms: cluster,point,time_fraction,current_nA\n");
+	for (int c = 0; c < km.k; c++) {
+		const struct burst* b = &bl.b[exemplar[c]];
+		if (b->cluster != c)
+			continue;
+		size_t n = b->last - b->first + 1;
+		printf("#cluster %d exemplar: burst at %" PRIu64 ", %" PRIu64 " us\n", c, b->start, b->duration);
+		for (int p = 0; p < EXEMPLAR_POINTS; p++) {
+			size_t i = b->first + (n - 1) * (size_t)p / (EXEMPLAR_POINTS - 1);
+			printf("%d,%d,%.4f,%" PRIu32 "\n", c, p, (double)p / (EXEMPLAR_POINTS - 1), cf.s[i].current);
+		}
+	}
+
+	free(bl.b);
+	free(cf.s);
+	return 0;
+}
+
+/*
+ * Template matching ("energytrace match"): finds the occurrences of a
+ * reference current trace in a long capture by normalized cross-correlation.
+ * The correlation with the zero-mean template is computed by overlap-save:
+ * each FFT block of N samples yields N - M + 1 outputs for an M-sample
+ * template. The output range is split into one chunk per core. Dividing by
+ * the template norm and the standard deviation of each capture window
+ * (from sliding sums, recomputed exactly every M steps against drift) gives
+ * a score in [-1, 1]. Samples are assumed to be evenly spaced.
+ */
+enum {
+	MATCH_MIN_FFT = 4096,
+};
+
+#define MATCH_DEFAULT_THRESHOLD 0.8
+
+struct match_job {
+	const struct capture_file* cf;
+	size_t                     m;         /* template length */
+	double                     offset;    /* capture mean, subtracted for precision */
+	double                     tnorm;     /* norm of the zero-mean template */
+	const struct fft*          fft;
+	const struct cpx*          spectrum;  /* conjugated template spectrum */
+	float*                     score;     /* one per template position */
+	bool                       failed;
+};
+
+static void match_chunk(void* arg, int part, int parts) {
+	struct match_job* j = arg;
+	const struct et_sample* s = j->cf->s;
+	size_t n = j->cf->n, m = j->m, positions = n - m + 1;
+	size_t from = positions * part / parts, to = positions * (part + 1) / parts;
+	uint32_t nfft = j->fft->n;
+	size_t step = nfft - m + 1;
+	struct cpx* buf = malloc(nfft * sizeof(*buf));
+	double sum = 0.0, sumsq = 0.0;
+
+	if (!buf) {
+		j->failed = true;
+		return;
+	}
+	for (size_t base = from; base < to; base += step) {
+		for (uint32_t k = 0; k < nfft; k++) {
+			buf[k].re = base + k < n ? s[base + k].current - j->offset : 0.0;
+			buf[k].im = 0.0;
+		}
+		fft_run(j->fft, buf, false);
+		for (uint32_t k = 0; k < nfft; k++) {
+			struct cpx a = buf[k], b = j->spectrum[k];
+			buf[k].re = a.re * b.re - a.im * b.im;
+			buf[k].im = a.re * b.im + a.im * b.re;
+		}
+		fft_run(j->fft, buf, true);
+
+		for (size_t k = 0; k < step && base + k < to; k++) {
+			size_t pos = base + k;
+			if ((pos - from) % m == 0) {
+				sum = sumsq = 0.0;
+				for (size_t i = pos; i < pos + m; i++) {
+					double x = s[i].current - j->offset;
+					sum += x;
+					sumsq += x * x;
+				}
+			} else {
+				double out = s[pos - 1].current - j->offset;
+				double in = s[pos + m - 1].current - j->offset;
+				sum += in - out;
+				sumsq += in * in - out * out;
+			}
+			double var = sumsq - sum * sum / (double)m;
+			double den = var > 0.0 ? sqrt(var) * j->tnorm : 0.0;
+			j->score[pos] = den > 0.0 ? (float)(buf[k].re / nfft / den) : 0.0f;
+		}
+	}
+	free(buf);
+}
+
+static int match_main(int argc, char* argv[]) {
+	if (argc < 3) {
+		printf("usage: energytrace match <capture> <template> [threshold]\n");
+		printf("  threshold  minimum normalized correlation, -1..1 (default: %.1f)\n",
+		       MATCH_DEFAULT_THRESHOLD);
+		return 1;
+	}
+	double threshold = argc >= 4 ? strtod(argv[3], NULL) : MATCH_DEFAULT_THRESHOLD;
+
+	struct capture_file cf, tf;
+	if (load_capture(argv[1], &cf) != 0)
+		return 1;
+	if (load_capture(argv[2], &tf) != 0) {
+		free(cf.s);
+		return 1;
+	}
+	size_t m = tf.n;
+	if (m < 2 || m > cf.n) {
+		fprintf(stderr, "Error: The template must have 2 to %zu samples.\n", cf.n);
+		free(cf.s);
+		free(tf.s);
+		return 1;
+	}
+
+	uint32_t nfft = MATCH_MIN_FFT;
+	while (nfft < 4 * m)
+		nfft <<= 1;
+	struct fft fft;
+	struct cpx* spectrum = malloc(nfft * sizeof(*spectrum));
+	float* score = malloc((cf.n - m + 1) * sizeof(*score));
+	if (fft_init(&fft, nfft) != 0 || !spectrum || !score) {
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+
+	double tmean = 0.0, tnorm = 0.0, offset = 0.0;
+	for (size_t i = 0; i < m; i++)
+		tmean += tf.s[i].current;
+	tmean /= (double)m;
+	for (uint32_t k = 0; k < nfft; k++) {
+		spectrum[k].re = k < m ? tf.s[k].current - tmean : 0.0;
+		spectrum[k].im = 0.0;
+		tnorm += spectrum[k].re * spectrum[k].re;
+	}
+	fft_run(&fft, spectrum, false);
+	for (uint32_t k = 0; k < nfft; k++)
+		spectrum[k].im = -spectrum[k].im;
+	for (size_t i = 0; i < cf.n; i++)
+		offset += cf.s[i].current;
+	offset /= (double)cf.n;
+
+	int threads = cpu_count();
+	if (threads > PARALLEL_MAX_THREADS)
+		threads = PARALLEL_MAX_THREADS;
+	if ((size_t)threads > cf.n - m + 1)
+		threads = (int)(cf.n - m + 1);
+	struct match_job job = { &cf, m, offset, sqrt(tnorm), &fft, spectrum, score, false };
+	parallel_for(threads, match_chunk, &job);
+	if (job.failed) {
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+
+	printf("#template: %zu samples, %" PRIu64 " us, %.9f J\n", m,
+	       tf.s[m - 1].timestamp - tf.s[0].timestamp,
+	       (uint32_t)(tf.s[m - 1].energy - tf.s[0].energy) * (ET_ENERGY_NJ * 1e-9));
+	printf("#%zu samples searched with %u-point FFTs on %d threads, threshold %.3f\n",
+	       cf.n, nfft, threads, threshold);
+	printf("#timestamp,score,energy_J,duration_us\n");
+
+	/* Report the best position of each run above the threshold; matches don't overlap. */
+	size_t positions = cf.n - m + 1, found = 0;
+	uint64_t energy = 0;
+	for (size_t pos = 0; pos < positions; pos++) {
+		if (score[pos] < threshold)
+			continue;
+		size_t best = pos;
+		for (size_t i = pos + 1; i < positions && i < pos + m; i++)
+			if (score[i] > score[best])
+				best = i;
+		uint32_t de = cf.s[best + m - 1].energy - cf.s[best].energy;
+		printf("%" PRIu64 ",%.4f,%.9f,%" PRIu64 "\n", cf.s[best].timestamp, score[best],
+		       de * (ET_ENERGY_NJ * 1e-9), cf.s[best + m - 1].timestamp - cf.s[best].timestamp);
+		found++;
+		energy += de;
+		pos = best + m - 1;
+	}
+	printf("#%zu matches, %.9f J in total\n", found, energy * (ET_ENERGY_NJ * 1e-9));
+
+	fft_free(&fft);
+	free(spectrum);
+	free(score);
+	free(cf.s);
+	free(tf.s);
+	return 0;
+}
+
+/*
+ * Change-point detection ("energytrace changepoints"): splits a capture into
+ * phases of constant mean current by binary segmentation. Each segment is modelled as
+ * Gaussian with its own mean and variance, so its cost is its length times
+ * the log of its variance; this copes with bursts that are far noisier than
+ * sleep. Every change costs a penalty (default 2 ln n, like BIC). The
+ * capture is cut into chunks that overlap their neighbours; each core
+ * segments whole chunks and keeps the boundaries inside the chunk's own
+ * part. A final pass drops boundaries whose removal costs less than the
+ * penalty, which also merges duplicates found on both sides of a seam.
+ */
+enum {
+	CHANGEPOINT_CHUNK      = 1 << 18,
+	CHANGEPOINT_OVERLAP    = 1 << 13,
+	CHANGEPOINT_MIN_LENGTH = 5,   /* at least 2, for a variance */
+	CHANGEPOINT_PASSES     = 10,
+};
+
+struct index_list {
+	size_t* v;
+	size_t  n, cap;
+};
+
+static int index_list_add(struct index_list* l, size_t x) {
+	if (l->n == l->cap) {
+		size_t cap = l->cap ? 2 * l->cap : 256;
+		size_t* v = realloc(l->v, cap * sizeof(*v));
+		if (!v)
+			return -1;
+		l->v = v;
+		l->cap = cap;
+	}
+	l->v[l->n++] = x;
+	return 0;
+}
+
+static int index_cmp(const void* a, const void* b) {
+	size_t x = *(const size_t*)a, y = *(const size_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Sum of squares as an unevaluated hi + lo pair, so long prefixes stay exact. */
+struct dd {
+	double hi, lo;
+};
+
+static struct dd dd_add(struct dd a, double b) {
+	double s = a.hi + b, bb = s - a.hi;
+	double e = (a.hi - (s - bb)) + (b - bb);
+	return (struct dd){ s, a.lo + e };
+}
+
+struct changepoint_job {
+	const struct capture_file* cf;
+	double                     penalty;
+	size_t                     min_length;
+	size_t                     chunks;
+	struct index_list*         found;    /* one per chunk */
+	bool                       failed;
+};
+
+/* Variances are floored at 1 nA^2 so that flat, quantized stretches don't cost minus infinity. */
+static double variance_cost(double sse, size_t m) {
+	double var = sse / (double)m;
+	return (double)m * log(var > 1.0 ? var : 1.0);
+}
+
+/* Cost of samples [a, b), from prefix sums over the chunk. */
+static double segment_cost(const int64_t* s1, const struct dd* s2, size_t a, size_t b) {
+	double sum = (double)(s1[b] - s1[a]);
+	double sq = (s2[b].hi - s2[a].hi) + (s2[b].lo - s2[a].lo);
+	return variance_cost(sq - sum * sum / (double)(b - a), b - a);
+}
+
+/*
+ * Binary segmentation of x[0, n): split at the point that lowers the cost
+ * most, as long as that gain beats the penalty, then recurse into both
+ * halves. Boundaries within [keep_from, keep_to) of the whole capture are
+ * appended to 'out' in order.
+ */
+static int binseg(const struct et_sample* x, size_t n, double penalty, size_t min_length,
+                  size_t base, size_t keep_from, size_t keep_to, struct index_list* out) {
+	struct span { size_t a, b; };
+	int64_t* s1 = malloc((n + 1) * sizeof(*s1));
+	struct dd* s2 = malloc((n + 1) * sizeof(*s2));
+	struct span* stack = malloc((n / min_length + 1) * sizeof(*stack));
+	struct index_list found = { 0 };
+	size_t depth = 0;
+	int rc = -1;
+
+	if (!s1 || !s2 || !stack)
+		goto out;
+	s1[0] = 0;
+	s2[0] = (struct dd){ 0.0, 0.0 };
+	for (size_t i = 0; i < n; i++) {
+		s1[i + 1] = s1[i] + x[i].current;
+		s2[i + 1] = dd_add(s2[i], (double)x[i].current * x[i].current);
+	}
+
+	stack[depth++] = (struct span){ 0, n };
+	while (depth > 0) {
+		struct span sp = stack[--depth];
+		if (sp.b - sp.a < 2 * min_length)
+			continue;
+		double whole = segment_cost(s1, s2, sp.a, sp.b), best = -INFINITY;
+		size_t arg = 0;
+		for (size_t t = sp.a + min_length; t + min_length <= sp.b; t++) {
+			double gain = whole - segment_cost(s1, s2, sp.a, t) - segment_cost(s1, s2, t, sp.b);
+			if (gain > best) {
+				best = gain;
+				arg = t;
+			}
+		}
+		if (best <= penalty)
+			continue;
+		if (base + arg >= keep_from && base + arg < keep_to && index_list_add(&found, base + arg) != 0)
+			goto out;
+		stack[depth++] = (struct span){ sp.a, arg };
+		stack[depth++] = (struct span){ arg, sp.b };
+	}
+
+	qsort(found.v, found.n, sizeof(*found.v), index_cmp);
+	for (size_t i = 0; i < found.n; i++)
+		if (index_list_add(out, found.v[i]) != 0)
+			goto out;
+	rc = 0;
+out:
+	free(s1);
+	free(s2);
+	free(stack);
+	free(found.v);
+	return rc;
+}
+
+static void changepoint_chunks(void* arg, int part, int parts) {
+	struct changepoint_job* j = arg;
+	size_t n = j->cf->n;
+	for (size_t c = (size_t)part; c < j->chunks; c += (size_t)parts) {
+		size_t from = n * c / j->chunks, to = n * (c + 1) / j->chunks;
+		size_t lo = from > CHANGEPOINT_OVERLAP ? from - CHANGEPOINT_OVERLAP : 0;
+		size_t hi = to + CHANGEPOINT_OVERLAP < n ? to + CHANGEPOINT_OVERLAP : n;
+		if (binseg(j->cf->s + lo, hi - lo, j->penalty, j->min_length, lo, from, to, &j->found[c]) != 0)
+			j->failed = true;
+	}
+}
+
+/* Cost of samples [a, b), summed directly. */
+static double segment_cost_direct(const struct et_sample* s, size_t a, size_t b) {
+	double mean = 0.0, sse = 0.0;
+	for (size_t i = a; i < b; i++)
+		mean += s[i].current;
+	mean /= (double)(b - a);
+	for (size_t i = a; i < b; i++)
+		sse += (s[i].current - mean) * (s[i].current - mean);
+	return variance_cost(sse, b - a);
+}
+
+static int changepoints_main(int argc, char* argv[]) {
+	const char* path = NULL;
+	double penalty = 0.0;
+	size_t min_length = CHANGEPOINT_MIN_LENGTH;
+
+	for (int i = 1; i < argc; i++) {
+		const char* v;
+		if ((v = option_value(argv[i], "min-length")) && *v)
+			min_length = (size_t)strtoul(v, NULL, 0);
+		else if (!path)
+			path = argv[i];
+		else
+			penalty = strtod(argv[i], NULL);
+	}
+	if (!path || min_length < 2 || penalty < 0.0) {
+		printf("usage: energytrace changepoints [--min-length=N] <capture> [penalty]\n");
+		printf("  penalty  cost of a change (default: 2 ln n for n samples)\n");
+		printf("  N        shortest segment in samples (default: %d)\n", CHANGEPOINT_MIN_LENGTH);
+		return 1;
+	}
+
+	struct capture_file cf;
+	if (load_capture(path, &cf) != 0)
+		return 1;
+	uint64_t t0 = host_time_us();
+
+	if (penalty == 0.0)
+		penalty = 2.0 * log((double)cf.n);
+
+	int threads = cpu_count();
+	if (threads > PARALLEL_MAX_THREADS)
+		threads = PARALLEL_MAX_THREADS;
+	size_t chunks = (cf.n + CHANGEPOINT_CHUNK - 1) / CHANGEPOINT_CHUNK;
+	if (chunks < (size_t)threads)
+		chunks = cf.n / (4 * CHANGEPOINT_OVERLAP) < (size_t)threads ? 1 : (size_t)threads;
+	if ((size_t)threads > chunks)
+		threads = (int)chunks;
+	struct changepoint_job job = { &cf, penalty, min_length, chunks, calloc(chunks, sizeof(struct index_list)), false };
+	if (!job.found) {
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+	parallel_for(threads, changepoint_chunks, &job);
+	if (job.failed) {
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+
+	/* Reconcile: join the chunks, then drop boundaries not worth their penalty. */
+	struct index_list cp = { 0 };
+	for (size_t c = 0; c < chunks; c++) {
+		for (size_t i = 0; i < job.found[c].n; i++) {
+			size_t x = job.found[c].v[i];
+			if (cp.n == 0 || x >= cp.v[cp.n - 1] + min_length)
+				index_list_add(&cp, x);
+		}
+		free(job.found[c].v);
+	}
+	free(job.found);
+	size_t merged = cp.n;
+	for (int pass = 0; pass < CHANGEPOINT_PASSES; pass++) {
+		size_t kept = 0, prev = 0;
+		for (size_t i = 0; i < cp.n; i++) {
+			size_t next = i + 1 < cp.n ? cp.v[i + 1] : cf.n;
+			double gain = segment_cost_direct(cf.s, prev, next) - segment_cost_direct(cf.s, prev, cp.v[i]) -
+			              segment_cost_direct(cf.s, cp.v[i], next);
+			if (gain >= penalty)
+				prev = cp.v[kept++] = cp.v[i];
+		}
+		if (kept == cp.n)
+			break;
+		cp.n = kept;
+	}
+	uint64_t elapsed = host_time_us() - t0;
+
+	printf("#%zu samples, penalty %.2f, %zu chunks on %d threads, %.3f s\n",
+	       cf.n, penalty, chunks, threads, elapsed / 1e6);
+	printf("#%zu change points (%zu before reconciling)\n", cp.n, merged);
+	printf("#start,duration_us,samples,mean_current_nA,energy_J\n");
+	for (size_t i = 0; i <= cp.n; i++) {
+		size_t a = i > 0 ? cp.v[i - 1] : 0, b = i < cp.n ? cp.v[i] : cf.n;
+		uint64_t end = b < cf.n ? cf.s[b].timestamp : cf.s[cf.n - 1].timestamp;
+		uint32_t de = cf.s[b < cf.n ? b : cf.n - 1].energy - cf.s[a].energy;
+		double mean = 0.0;
+		for (size_t k = a; k < b; k++)
+			mean += cf.s[k].current;
+		printf("%" PRIu64 ",%" PRIu64 ",%zu,%.1f,%.9f\n", cf.s[a].timestamp, end - cf.s[a].timestamp,
+		       b - a, mean / (double)(b - a), de * (ET_ENERGY_NJ * 1e-9));
+	}
+
+	free(cp.v);
+	free(cf.s);
+	return 0;
+}
+
+/*
+ * Probe session: initialize the interface, power and open the target, and
+ * print what was found. The session stays open across all measurements of
+ * a run until session_close().
+ */
+static int session_open(const char* port, long vcc, union DEVICE_T* device) {
+	STATUS_T status;
+	int32_t version;
+
+	printf("#Initializing the interface: ");
+	status = MSP430_Initialize(port, &version);
+	printf("#MSP430_Initialize(portNumber=%s, version=%d) returns %d\n", port, version, status);
+	if(status != STATUS_OK) {
+		fprintf(stderr, "Error: %s\n", MSP430_Error_String(MSP430_Error_Number()));
+		if(version == -1 || version == -3) {
+			fprintf(stderr, "Note: DLL/firmware version mismatch (version=%d).\n"
+			                "Consider updating the MSP Debug Stack or FET firmware.\n", version);
+		}
+		return 1;
+	}
+
+	// 2. Set the device Vcc.
+	printf("#Setting the device Vcc: ");
+	status = MSP430_VCC(vcc);
+	printf("#MSP430_VCC(%d) returns %d\n", vcc, status);
+
+
+	// 3. Open the device.
+#ifdef _WIN32
+	if (MSP430_LoadDeviceDb)
+#endif
+		MSP430_LoadDeviceDb(NULL); //Required in more recent versions of tilib.
+	printf("#Opening the device: ");
+	status = MSP430_OpenDevice("DEVICE_UNKNOWN", "", 0, 0, DEVICE_UNKNOWN);
+	printf("#MSP430_OpenDevice() returns %d\n", status);
+	if(status != STATUS_OK) {
+		fprintf(stderr, "Error: %s\n", MSP430_Error_String(MSP430_Error_Number()));
+		return 1;
+	}
+
+	// 4. Get device information
+	status = MSP430_GetFoundDevice((uint8_t*)device, sizeof(device->buffer));
+	printf("#MSP430_GetFoundDevice() returns %d\n", status);
+	printf("# device.id: %d\n", device->id);
+	printf("# device.string: %s\n", device->string);
+	printf("# device.mainStart: 0x%04x\n", device->mainStart);
+	printf("# device.infoStart: 0x%04x\n", device->infoStart);
+	printf("# device.ramEnd: 0x%04x\n", device->ramEnd);
+	printf("# device.nBreakpoints: %d\n", device->nBreakpoints);
+	printf("# device.emulation: %d\n", device->emulation);
+	printf("# device.clockControl: %d\n", device->clockControl);
+	printf("# device.lcdStart: 0x%04x\n", device->lcdStart);
+	printf("# device.lcdEnd: 0x%04x\n", device->lcdEnd);
+	printf("# device.vccMinOp: %d\n", device->vccMinOp);
+	printf("# device.vccMaxOp: %d\n", device->vccMaxOp);
+	printf("# device.hasTestVpp: %d\n", device->hasTestVpp);
+	return 0;
+}
+
+static void session_close(void) {
+	STATUS_T status;
+	printf("#Closing the interface: ");
+	status = MSP430_Close(0);
+	printf("#MSP430_Close(FALSE) returns %d\n", status);
+}
+
+static void eem_event(uint32_t msg, uint32_t wparam, int32_t lparam, int32_t client) {
+	/* The state is polled with MSP430_State() instead. */
+	(void)msg, (void)wparam, (void)lparam, (void)client;
+}
+
+/* Arm code breakpoints on the region's start and stop addresses. */
+static int region_arm(uint32_t start, uint32_t stop) {
+	MessageID_t ids = { 0 };
+	BpParameter_t bp;
+	uint16_t handle;
+	STATUS_T status = MSP430_EEM_Init(eem_event, 0, &ids);
+	printf("#MSP430_EEM_Init() returns %d\n", status);
+	if (status != STATUS_OK)
+		return -1;
+	for (int i = 0; i < 2; i++) {
+		memset(&bp, 0, sizeof(bp));
+		bp.bpMode = BP_CODE;
+		bp.lAddrVal = (int32_t)(i == 0 ? start : stop);
+		bp.bpAction = BP_BRK;
+		handle = 0;
+		status = MSP430_EEM_SetBreakpoint(&handle, &bp);
+		printf("#MSP430_EEM_SetBreakpoint(0x%05" PRIx32 ") returns %d\n", (uint32_t)bp.lAddrVal, status);
+		if (status != STATUS_OK)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Count CPU cycles on counter 0 while the target runs. Advanced mode is
+ * needed because basic mode keeps counter 0 for the debugger itself.
+ */
+static int cycles_arm(void) {
+	CycleCounterConfig_t cfg = { CYC_COUNT_ON_IFCLK, CYC_START_ON_RELEASE, CYC_STOP_ON_DBG_HALT,
+	                             CYC_CLEAR_NO_EVENT };
+	STATUS_T status = MSP430_EEM_SetCycleCounterMode(CYC_MODE_ADVANCED);
+	printf("#MSP430_EEM_SetCycleCounterMode() returns %d\n", status);
+	if (status != STATUS_OK)
+		return -1;
+	status = MSP430_EEM_ConfigureCycleCounter(0, cfg);
+	printf("#MSP430_EEM_ConfigureCycleCounter() returns %d\n", status);
+	return status == STATUS_OK ? 0 : -1;
+}
+
+/* Run until a breakpoint is hit; returns the PC there, or -1 on an error or at the deadline. */
+static int32_t run_to_breakpoint(uint64_t deadline) {
+	int32_t state, cycles, pc;
+	if (MSP430_Run(RUN_TO_BREAKPOINT, 0) != STATUS_OK)
+		return -1;
+	for (;;) {
+		if (MSP430_State(&state, 0, &cycles) != STATUS_OK)
+			return -1;
+		if (state == BREAKPOINT_HIT || state == STOPPED)
+			break;
+		if (capture_stop || host_time_us() >= deadline) {
+			MSP430_State(&state, 1, &cycles);
+			return -1;
+		}
+		sleep_ms(REGION_POLL_MS);
+	}
+	if (MSP430_Register(&pc, PC, READ) != STATUS_OK)
+		return -1;
+	return pc;
+}
+
+/* Measure up to 'n' iterations of start..stop; returns the number completed. */
+static unsigned int region_measure(struct region* r, uint32_t start, uint32_t stop, unsigned int n,
+                                   unsigned int seconds, bool cycles, struct region_result* res) {
+	uint64_t deadline = host_time_us() + (uint64_t)seconds * 1000000;
+	unsigned int done = 0;
+	int32_t pc;
+
+	while (done < n) {
+		do
+			pc = run_to_breakpoint(deadline);
+		while (pc >= 0 && (uint32_t)pc != start);
+		if (pc < 0)
+			break;
+		region_switch(r, true, NULL);
+		if (cycles && MSP430_EEM_ResetCycleCounter(0) != STATUS_OK)
+			break;
+		do
+			pc = run_to_breakpoint(deadline);
+		while (pc >= 0 && (uint32_t)pc != stop);
+		region_switch(r, false, &res[done]);
+		if (pc < 0)
+			break;
+		if (cycles && MSP430_EEM_ReadCycleCounterValue(0, &res[done].cycles) != STATUS_OK)
+			break;
+		done++;
+	}
+	return done;
+}
+
+static int result_energy_cmp(const void* a, const void* b) {
+	uint32_t x = ((const struct region_result*)a)->energy, y = ((const struct region_result*)b)->energy;
+	return x < y ? -1 : x > y;
+}
+
+static void region_print(uint32_t start, uint32_t stop, struct region_result* res, unsigned int n,
+                         bool cycles) {
+	double mean = 0.0, m2 = 0.0, duration = 0.0;
+	double energy = 0.0, total_cycles = 0.0, cmean = 0.0, cm2 = 0.0;
+	unsigned int counted = 0;
+	printf("#Region 0x%05" PRIx32 "..0x%05" PRIx32 ": %u iterations\n", start, stop, n);
+	for (unsigned int i = 0; i < n; i++) {
+		double e = res[i].energy * (ET_ENERGY_NJ * 1e-9), d = e - mean;
+		if (cycles && res[i].cycles) {
+			double c = e * 1e9 / res[i].cycles, dc = c - cmean;
+			printf("#  iteration %u: %.9f J, %" PRIu64 " us, %" PRIu64 " samples, %" PRIu64
+			       " cycles, %.4f nJ/cycle\n", i + 1, e, res[i].duration, res[i].samples,
+			       res[i].cycles, c);
+			counted++;
+			cmean += dc / counted;
+			cm2 += dc * (c - cmean);
+			energy += e;
+			total_cycles += res[i].cycles;
+		} else {
+			printf("#  iteration %u: %.9f J, %" PRIu64 " us, %" PRIu64 " samples\n",
+			       i + 1, e, res[i].duration, res[i].samples);
+		}
+		mean += d / (i + 1);
+		m2 += d * (e - mean);
+		duration += res[i].duration;
+	}
+	if (n == 0)
+		return;
+	if (counted) {
+		printf("#  %.4f nJ/cycle over %.0f cycles, %.1f cycles per iteration\n",
+		       energy * 1e9 / total_cycles, total_cycles, total_cycles / counted);
+		if (counted > 1)
+			printf("#  nJ/cycle per iteration: mean %.4f +- %.4f (95%% confidence)\n", cmean,
+			       student_t95(counted - 1.0) * sqrt(cm2 / (counted - 1)) / sqrt((double)counted));
+	}
+	qsort(res, n, sizeof(*res), result_energy_cmp);
+	double sd = n > 1 ? sqrt(m2 / (n - 1)) : 0.0;
+	printf("#  energy per iteration: mean %.9f J, stddev %.9f J, min %.9f J, median %.9f J, max %.9f J\n",
+	       mean, sd, res[0].energy * (ET_ENERGY_NJ * 1e-9),
+	       (n % 2 ? res[n / 2].energy : (res[n / 2 - 1].energy + res[n / 2].energy) / 2.0) * (ET_ENERGY_NJ * 1e-9),
+	       res[n - 1].energy * (ET_ENERGY_NJ * 1e-9));
+	if (n > 1)
+		printf("#  mean +- %.9f J (95%% confidence), mean duration %.1f us\n",
+		       student_t95(n - 1.0) * sd / sqrt((double)n), duration / n);
+}
+
+/*
+ * Parse one line of a plan: KEY=VALUE settings out of vcc=MV,
+ * run=free|jtag|halt, seconds=S or samples=N, reset=yes|no and settle=MS.
+ * Returns 1 for a phase, 0 for a blank or comment line and -1 on an error.
+ */
+static int plan_parse_line(char* line, struct plan_phase* ph, double* settle_ms) {
+	char* hash = strchr(line, '#');
+	bool any = false;
+	if (hash)
+		*hash = '\0';
+	for (char* key = strtok(line, " \t\r\n"); key; key = strtok(NULL, " \t\r\n")) {
+		char* v = strchr(key, '=');
+		if (!v || !v[1])
+			return -1;
+		*v++ = '\0';
+		any = true;
+		if (strcmp(key, "vcc") == 0)
+			ph->vcc = strtol(v, NULL, 0);
+		else if (strcmp(key, "run") == 0)
+			ph->run = lookup_name(plan_run_names, 3, v);
+		else if (strcmp(key, "seconds") == 0)
+			ph->seconds = strtod(v, NULL);
+		else if (strcmp(key, "samples") == 0)
+			ph->samples = strtoull(v, NULL, 0);
+		else if (strcmp(key, "reset") == 0 && (strcmp(v, "yes") == 0 || strcmp(v, "no") == 0))
+			ph->reset = strcmp(v, "yes") == 0;
+		else if (strcmp(key, "settle") == 0)
+			*settle_ms = strtod(v, NULL);
+		else
+			return -1;
+	}
+	if (!any)
+		return 0;
+	return ph->vcc > 0 && ph->run >= 0 && (ph->seconds > 0.0) != (ph->samples > 0) ? 1 : -1;
+}
+
+/*
+ * Append a phase, preceded by its settling time as a phase of its own:
+ * the new settings apply from its start, but it isn't reported.
+ */
+static int plan_add(struct plan* p, const struct plan_phase* ph, double settle_ms) {
+	if (p->n + (settle_ms > 0.0) + 1 > PLAN_MAX_PHASES)
+		return -1;
+	p->phase[p->n] = *ph;
+	if (settle_ms > 0.0) {
+		p->phase[p->n].seconds = settle_ms / 1000.0;
+		p->phase[p->n].samples = 0;
+		p->phase[p->n].settle = true;
+		p->phase[++p->n] = *ph;
+		p->phase[p->n].reset = false;
+		p->seconds += settle_ms / 1000.0;
+	}
+	p->n++;
+	p->seconds += ph->seconds;
+	return 0;
+}
+
+/* Load a plan file; phases without vcc= keep the previous phase's supply. */
+static int plan_load(const char* path, struct plan* p) {
+	FILE* f = fopen(path, "r");
+	char line[1024];
+	unsigned int lineno = 0;
+	long vcc = 3300;
+	int rc = 0;
+
+	if (!f) {
+		fprintf(stderr, "Error: Could not open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	p->n = 0;
+	p->seconds = 0.0;
+	while (rc == 0 && fgets(line, sizeof(line), f)) {
+		struct plan_phase ph = { vcc, PLAN_RUN_FREE, 0.0, 0, false, false };
+		double settle_ms = 0.0;
+		lineno++;
+		int r = plan_parse_line(line, &ph, &settle_ms);
+		if (r < 0 || (r > 0 && plan_add(p, &ph, settle_ms) != 0)) {
+			fprintf(stderr, "Error: %s:%u: expected vcc=MV, run=free|jtag|halt, seconds=S or samples=N, "
+			                "reset=yes|no, settle=MS.\n", path, lineno);
+			rc = -1;
+		} else if (r > 0) {
+			vcc = ph.vcc;
+		}
+	}
+	fclose(f);
+	if (rc == 0 && p->n == 0) {
+		fprintf(stderr, "Error: %s has no phases.\n", path);
+		rc = -1;
+	}
+	return rc;
+}
+
+/*
+ * A supply sweep as a plan: 'seconds' at every 'step' mV from 'low' up to
+ * 'high' (included), each after 'settle_ms' at the new voltage.
+ */
+static int plan_sweep(struct plan* p, long low, long high, long step, double settle_ms, double seconds) {
+	p->n = 0;
+	p->seconds = 0.0;
+	for (long vcc = low; vcc < high + step; vcc += step) {
+		struct plan_phase ph = { vcc < high ? vcc : high, PLAN_RUN_FREE, seconds, 0, false, false };
+		if (plan_add(p, &ph, settle_ms) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static bool plan_halts(const struct plan* p) {
+	for (unsigned int k = 0; k < p->n; k++)
+		if (p->phase[k].run == PLAN_RUN_HALT)
+			return true;
+	return false;
+}
+
+static int plan_apply(const struct plan_phase* ph, long* vcc) {
+	STATUS_T status = STATUS_OK;
+	int32_t state, cycles;
+	if (ph->vcc != *vcc) {
+		status = MSP430_VCC(ph->vcc);
+		*vcc = ph->vcc;
+	}
+	if (status == STATUS_OK && ph->reset)
+		status = MSP430_Reset(RST_RESET, 0, 0);
+	if (status == STATUS_OK) {
+		if (ph->run == PLAN_RUN_HALT)
+			status = MSP430_State(&state, 1, &cycles);
+		else
+			status = MSP430_Run(FREE_RUN, ph->run == PLAN_RUN_FREE);
+	}
+	return status == STATUS_OK ? 0 : -1;
+}
+
+/* Run the phases of a plan; returns the number started. */
+/* The phase the callback is in, whether it is full, and how many samples it has. */
+static unsigned int phases_state(struct phases* p, bool* full, uint64_t* taken) {
+	mutex_lock(&p->lock);
+	unsigned int current = p->current;
+	*full = p->full;
+	*taken = p->taken;
+	mutex_unlock(&p->lock);
+	return current;
+}
+
+static unsigned int plan_run(struct phases* p, EnergyTraceHandle ha, long vcc) {
+	unsigned int k;
+	bool full;
+	uint64_t taken;
+	for (k = 0; k < p->plan->n && !capture_stop; k++) {
+		const struct plan_phase* ph = &p->plan->phase[k];
+		if (k > 0) {
+			mutex_lock(&p->lock);
+			p->requested = k;
+			mutex_unlock(&p->lock);
+			if (MSP430_ResetEnergyTrace(ha) != STATUS_OK)
+				break;
+		}
+		if (plan_apply(ph, &vcc) != 0) {
+			fprintf(stderr, "Error: Phase %u: %s\n", k + 1, MSP430_Error_String(MSP430_Error_Number()));
+			return k + 1;
+		}
+		/* Start timing once the callback has seen the boundary. */
+		uint64_t end = host_time_us() + PLAN_SAMPLES_SLACK_MS * 1000ULL;
+		while (!capture_stop && phases_state(p, &full, &taken) != k && host_time_us() < end)
+			sleep_ms(PLAN_POLL_MS);
+		if (!capture_stop && phases_state(p, &full, &taken) != k) {
+			fprintf(stderr, "Error: Phase %u: no samples arrived.\n", k + 1);
+			return k + 1;
+		}
+		/* Counted phases give up if the samples stop coming. */
+		end = host_time_us() + (ph->samples ? ph->samples * 1000000 / PLAN_MIN_RATE_HZ
+		                                      + PLAN_SAMPLES_SLACK_MS * 1000ULL
+		                                    : (uint64_t)(ph->seconds * 1e6));
+		while (!capture_stop && host_time_us() < end) {
+			phases_state(p, &full, &taken);
+			if (ph->samples && full)
+				break;
+			sleep_ms(PLAN_POLL_MS);
+		}
+		phases_state(p, &full, &taken);
+		if (ph->samples && !full && !capture_stop) {
+			fprintf(stderr, "Error: Phase %u: only %" PRIu64 " of %" PRIu64 " samples arrived in time.\n",
+			        k + 1, taken, ph->samples);
+			return k + 1;
+		}
+	}
+	return k;
+}
+
+/* Run the target freely for 'seconds' and only gather summary statistics. */
+static int capture_summary(struct summary* summary, unsigned int seconds) {
+	struct capture cap = { 0 };
+	EnergyTraceSetup ets = { ET_PROFILING_ANALOG, ET_PROFILING_1K, ET_ALL, ET_EVENT_WINDOW_100,
+	                         ET_CALLBACKS_ONLY_DURING_RUN };
+	EnergyTraceCallbacks cbs = { .pContext = &cap, .pPushDataFn = push_cb, .pErrorOccurredFn = error_cb };
+	EnergyTraceHandle ha;
+	STATUS_T status;
+
+	cap.no_samples = true;
+	cap.summary = summary;
+	summary_reset(summary);
+	fflush(stdout);
+	if (sink_open(&cap.out, fileno(stdout), SINK_AUTO) != 0) {
+		fprintf(stderr, "Error: Could not allocate output buffers.\n");
+		return -1;
+	}
+	mutex_init(&cap.lock);
+	MSP430_Run(FREE_RUN, 1);
+	status = MSP430_EnableEnergyTrace(&ets, &cbs, &ha);
+	if (status == STATUS_OK) {
+		status = MSP430_ResetEnergyTrace(ha);
+		if (status == STATUS_OK)
+			capture_wait(seconds);
+		MSP430_DisableEnergyTrace(ha);
+	}
+	sink_close(&cap.out);
+	mutex_destroy(&cap.lock);
+	if (status != STATUS_OK) {
+		fprintf(stderr, "Error: %s\n", MSP430_Error_String(MSP430_Error_Number()));
+		return -1;
+	}
+	return 0;
+}
+
+/* Configure the current drive, probing the workload first in auto mode. */
+static int current_drive_setup(int drive, uint32_t fine_max) {
+	static struct summary probe;
+	STATUS_T status;
+	bool fine = drive == CURRENT_DRIVE_FINE;
+	if (drive == CURRENT_DRIVE_AUTO) {
+		/* Probe with coarse drive, which covers the full current range. */
+		if (MSP430_Configure(ET_CURRENTDRIVE_FINE, 0) != STATUS_OK) {
+			fprintf(stderr, "Error: %s\n", MSP430_Error_String(MSP430_Error_Number()));
+			return -1;
+		}
+		if (capture_summary(&probe, CURRENT_DRIVE_PROBE_SECONDS) != 0)
+			return -1;
+		fine = probe.count > 0 && probe.i_max <= fine_max;
+	}
+	status = MSP430_Configure(ET_CURRENTDRIVE_FINE, fine);
+	printf("#MSP430_Configure(ET_CURRENTDRIVE_FINE, %d) =%d\n", fine, status);
+	if (status != STATUS_OK) {
+		fprintf(stderr, "Error: %s\n", MSP430_Error_String(MSP430_Error_Number()));
+		return -1;
+	}
+	if (drive == CURRENT_DRIVE_AUTO)
+		printf("#Current drive: %s (auto: peak %" PRIu32 " nA, p99 %.0f nA in a %d s probe, fine up to %"
+		       PRIu32 " nA)\n", fine ? "fine" : "coarse", probe.i_max, tdigest_quantile(&probe.digest, 0.99),
+		       CURRENT_DRIVE_PROBE_SECONDS, fine_max);
+	else
+		printf("#Current drive: %s\n", fine ? "fine" : "coarse");
+	return 0;
+}
+
+/*
+ * A/B benchmark: each round programs every image in turn, resets the
+ * target and captures it for the same time, so slow drift (temperature,
+ * battery, supply) hits all builds alike instead of biasing the one that
+ * ran last. Energies are normalized to the nominal duration and compared
+ * to the first image with Welch's t-test.
+ */
+enum {
+	AB_MAX_IMAGES      = 8,
+	AB_DEFAULT_REPEATS = 10,
+};
+
+static void ab_stats(const double* x, unsigned int n, double* mean, double* var) {
+	double m = 0.0, m2 = 0.0;
+	for (unsigned int i = 0; i < n; i++) {
+		double d = x[i] - m;
+		m += d / (i + 1);
+		m2 += d * (x[i] - m);
+	}
+	*mean = m;
+	*var = n > 1 ? m2 / (n - 1) : 0.0;
+}
+
+static void ab_print(const char* const* images, int nimages, double* const* energy, unsigned int runs,
+                     unsigned int seconds) {
+	double mean[AB_MAX_IMAGES], var[AB_MAX_IMAGES];
+	printf("#A/B: %u runs of %u s per image\n", runs, seconds);
+	for (int i = 0; i < nimages; i++) {
+		ab_stats(energy[i], runs, &mean[i], &var[i]);
+		printf("#  %c %s: mean %.9f J", 'A' + i, images[i], mean[i]);
+		if (runs > 1)
+			printf(", stddev %.9f J, +- %.9f J (95%% confidence)", sqrt(var[i]),
+			       student_t95(runs - 1.0) * sqrt(var[i] / runs));
+		printf("\n");
+	}
+	if (runs < 2)
+		return;
+	for (int i = 1; i < nimages; i++) {
+		double diff = mean[i] - mean[0];
+		double se2 = (var[0] + var[i]) / runs;
+		printf("#  %c - A: %+.9f J (%+.3f%%)", 'A' + i, diff, mean[0] > 0.0 ? 100.0 * diff / mean[0] : 0.0);
+		if (se2 > 0.0) {
+			/* Welch-Satterthwaite degrees of freedom, with equal run counts. */
+			double df = se2 * se2 * (runs - 1.0) * runs * runs / (var[0] * var[0] + var[i] * var[i]);
+			double t = diff / sqrt(se2), crit = student_t95(df);
+			printf(" +- %.9f J, t %.3f, df %.1f, %s at 5%%", crit * sqrt(se2), t, df,
+			       fabs(t) > crit ? "significant" : "not significant");
+		}
+		printf("\n");
+	}
+}
+
+static int ab_main(int argc, char* argv[]) {
+	const char* port = "TIUSB";
+	const char* images[AB_MAX_IMAGES];
+	int nimages = 0;
+	unsigned int seconds = 0, repeats = AB_DEFAULT_REPEATS;
+
+	for (int i = 1; i < argc; i++) {
+		const char* v;
+		if ((v = option_value(argv[i], "repeats")) && *v)
+			repeats = (unsigned int)strtoul(v, NULL, 0);
+		else if ((v = option_value(argv[i], "port")) && *v)
+			port = v;
+		else if (seconds == 0)
+			seconds = (unsigned int)strtoul(argv[i], NULL, 0);
+		else if (nimages < AB_MAX_IMAGES)
+			images[nimages++] = argv[i];
+		else
+			nimages = AB_MAX_IMAGES + 1;
+	}
+	if (seconds == 0 || repeats == 0 || nimages < 2 || nimages > AB_MAX_IMAGES) {
+		printf("usage: energytrace ab [--repeats=N] [--port=PORT] <seconds> <image> <image> [...]\n");
+		printf("  seconds  capture time per run\n");
+		printf("  image    firmware file for MSP430_ProgramFile, 2 to %d of them\n", AB_MAX_IMAGES);
+		printf("  N        runs per image (default: %d)\n", AB_DEFAULT_REPEATS);
+		return 1;
+	}
+
+#ifdef _WIN32
+	if (LoadMSP430() != 0)
+		return 1;
+#endif
+
+	double* energy[AB_MAX_IMAGES];
+	for (int i = 0; i < nimages; i++) {
+		energy[i] = calloc(repeats, sizeof(double));
+		if (!energy[i]) {
+			fprintf(stderr, "Error: Out of memory.\n");
+			return 1;
+		}
+	}
+
+	union DEVICE_T device;
+	if (session_open(port, 3300, &device) != 0)
+		return 1;
+
+	static struct summary summary;
+	STATUS_T status;
+	unsigned int runs = 0;
+	int failed = 0;
+
+	for (unsigned int r = 0; r < repeats && !failed; r++) {
+		for (int i = 0; i < nimages; i++) {
+			status = MSP430_ProgramFile(images[i], ERASE_MAIN, 1);
+			if (status == STATUS_OK)
+				status = MSP430_Reset(RST_RESET, 0, 0);
+			if (status != STATUS_OK) {
+				fprintf(stderr, "Error: Programming %s: %s\n", images[i],
+				        MSP430_Error_String(MSP430_Error_Number()));
+				failed = 1;
+				break;
+			}
+			if (capture_summary(&summary, seconds) != 0) {
+				failed = 1;
+				break;
+			}
+			double secs = summary_seconds(&summary);
+			energy[i][r] = secs > 0.0 ? summary_joules(&summary) * seconds / secs : 0.0;
+			printf("#Run %u %c: %.9f J, %" PRIu64 " samples\n", r + 1, 'A' + i, energy[i][r], summary.count);
+			fflush(stdout);
+		}
+		if (!failed)
+			runs++;
+	}
+
+	ab_print(images, nimages, energy, runs, seconds);
+	for (int i = 0; i < nimages; i++)
+		free(energy[i]);
+	session_close();
+	return failed;
+}
+
+int main(int argc, char *argv[]) {
+#ifndef _WIN32
+	if (argc >= 2 && strcmp(argv[1], "shm-read") == 0)
+		return shm_read_main(argc - 1, argv + 1);
+#endif
+	if (argc >= 2 && strcmp(argv[1], "pyramid-view") == 0)
+		return pyramid_view_main(argc - 1, argv + 1);
+	if (argc >= 2 && strcmp(argv[1], "cluster") == 0)
+		return cluster_main(argc - 1, argv + 1);
+	if (argc >= 2 && strcmp(argv[1], "match") == 0)
+		return match_main(argc - 1, argv + 1);
+	if (argc >= 2 && strcmp(argv[1], "changepoints") == 0)
+		return changepoints_main(argc - 1, argv + 1);
+	if (argc >= 2 && strcmp(argv[1], "ab") == 0)
+		return ab_main(argc - 1, argv + 1);
+
+	struct options opt = {
+		.writer = SINK_AUTO,
+		.trigger_pre = TRIGGER_DEFAULT_PRE,
+		.trigger_post = TRIGGER_DEFAULT_POST,
+		.iterations = REGION_DEFAULT_ITERATIONS,
+		.watch_interval = WATCH_DEFAULT_INTERVAL_MS,
+		.current_drive = -1,
+		.host_clock = -1,
+		.fine_max = CURRENT_DRIVE_FINE_MAX_NA,
+	};
+	if(parse_args(argc, argv, &opt) != 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	unsigned int duration = opt.duration;
+	static struct plan plan;
+	if (opt.plan_path) {
+		if (plan_load(opt.plan_path, &plan) != 0)
+			return 1;
+		duration = (unsigned int)ceil(plan.seconds);
+	}
+
+	struct capture cap = { 0 };
+	static struct didt didt;
+	cap.didt = NULL;
+	if (opt.didt_spec) {
+		if (didt_init(&didt, opt.didt_spec) != 0) {
+			fprintf(stderr, "Error: Bad filter '%s' for --didt.\n", opt.didt_spec);
+			return 1;
+		}
+		cap.didt = &didt;
+		if (didt.kind == DIDT_FIR)
+			printf("#Column 5: current from dE/dt, %d-tap FIR\n", didt.taps);
+		else
+			printf("#Column 5: current from dE/dt, IIR alpha %g\n", didt.alpha);
+	}
+	static struct clock_sync clock_sync;
+	if (opt.host_clock >= 0) {
+		clock_init(&clock_sync, opt.host_clock);
+		cap.clock = &clock_sync;
+		cap.host_column = true;
+		printf("#Column %d: host %s time in us, from the callback arrival times\n", cap.didt ? 6 : 5,
+		       host_clock_names[opt.host_clock]);
+	}
+
+#ifdef _WIN32
+	if (LoadMSP430() != 0)
+		return 1;
+#endif
+
+	STATUS_T status;
+	long  vcc = 3300;
+	union DEVICE_T device;
+	struct pyramid pyramid;
+	static struct summary summary;
+	static struct histograms hist;
+	struct psd psd;
+	static struct battery battery;
+	static struct autostop autostop;
+	static struct region region;
+	static struct watch watch;
+	static struct phases phases;
+	unsigned int started = 0;
+	static struct markers markers;
+	static struct line_reader serial, control;
+	struct region_result* results = NULL;
+	unsigned int iterations = 0;
+	struct trigger trigger;
+	struct segment_log segments;
+#ifndef _WIN32
+	struct bcast bcast;
+	struct server server;
+#endif
+
+	if (session_open(opt.port, vcc, &device) != 0)
+		return 1;
+	if (opt.current_drive >= 0 && current_drive_setup(opt.current_drive, opt.fine_max) != 0)
+		return 1;
+
+
+	EnergyTraceSetup ets = {  ET_PROFILING_ANALOG,                // Gives callbacks of with eventID 8
+                      ET_PROFILING_1K,                   // N/A
+                      ET_ALL,                             // N/A
+                      ET_EVENT_WINDOW_100,                // N/A
+                      ET_CALLBACKS_ONLY_DURING_RUN };           // Callbacks are continuously
+	EnergyTraceHandle ha;
+	EnergyTraceCallbacks cbs = {
+		.pContext = &cap,
+		.pPushDataFn = push_cb,
+		.pErrorOccurredFn = error_cb
+	};
+
+	cap.no_samples = opt.no_samples;
+	if (opt.summary) {
+		summary_reset(&summary);
+		cap.summary = &summary;
+	}
+	if (opt.histogram) {
+		cap.hist = &hist;
+#ifndef _WIN32
+		signal(SIGUSR1, on_dump_signal);
+#endif
+	}
+
+	if (opt.psd) {
+		if (psd_init(&psd, opt.psd) != 0) {
+			fprintf(stderr, "Error: Could not allocate the spectrum buffers.\n");
+			return 1;
+		}
+		cap.psd = &psd;
+	}
+
+	if (opt.battery_capacity > 0.0) {
+		battery_init(&battery, opt.battery_capacity, opt.battery_self_discharge, opt.battery_converge);
+		cap.battery = &battery;
+	} else if (opt.battery_converge > 0.0) {
+		fprintf(stderr, "Error: --battery-stop needs --battery.\n");
+		return 1;
+	}
+
+	if (opt.autostop > 0.0) {
+		autostop_init(&autostop, opt.autostop);
+		cap.autostop = &autostop;
+	}
+
+	if (opt.region) {
+		if (region_arm(opt.region_start, opt.region_stop) != 0) {
+			fprintf(stderr, "Error: %s\n", MSP430_Error_String(MSP430_Error_Number()));
+			return 1;
+		}
+		results = calloc(opt.iterations, sizeof(*results));
+		if (!results) {
+			fprintf(stderr, "Error: Out of memory.\n");
+			return 1;
+		}
+		mutex_init(&region.lock);
+		cap.region = &region;
+		if (opt.cycles && cycles_arm() != 0) {
+			fprintf(stderr, "Error: %s\n", MSP430_Error_String(MSP430_Error_Number()));
+			return 1;
+		}
+	} else if (opt.cycles) {
+		fprintf(stderr, "Error: --cycles needs --region.\n");
+		return 1;
+	}
+
+	if (opt.sweep_step) {
+		if (opt.plan_path) {
+			fprintf(stderr, "Error: --sweep can't be combined with --plan.\n");
+			return 1;
+		}
+		if (device.vccMinOp <= 0 || device.vccMaxOp < device.vccMinOp) {
+			fprintf(stderr, "Error: The device reports no supply voltage range.\n");
+			return 1;
+		}
+		if (plan_sweep(&plan, device.vccMinOp, device.vccMaxOp, opt.sweep_step, opt.sweep_settle,
+		               duration) != 0) {
+			fprintf(stderr, "Error: --sweep gives more than %d phases.\n", PLAN_MAX_PHASES);
+			return 1;
+		}
+		printf("#Sweep: %d to %d mV in %ld mV steps, %u s each after %g ms settling\n",
+		       device.vccMinOp, device.vccMaxOp, opt.sweep_step, duration, opt.sweep_settle);
+		duration = (unsigned int)ceil(plan.seconds);
+	}
+
+	if (opt.plan_path || opt.sweep_step) {
+		if (opt.region) {
+			fprintf(stderr, "Error: --plan and --sweep can't be combined with --region.\n");
+			return 1;
+		}
+		phases_init(&phases, &plan);
+		cap.phases = &phases;
+		if (plan_halts(&plan))
+			ets.ETCallback = ET_CALLBACKS_CONTINUOUS;
+		if (opt.plan_path)
+			printf("#Plan: %s, %u phases\n", opt.plan_path, plan.n);
+		printf("#phase 1: vcc %ld mV, run %s%s\n", plan.phase[0].vcc, plan_run_names[plan.phase[0].run],
+		       plan.phase[0].settle ? ", settling" : "");
+	}
+
+	if (opt.serial_spec || opt.control_path) {
+		if (!cap.clock) {
+			clock_init(&clock_sync, HOST_CLOCK_MONOTONIC);
+			cap.clock = &clock_sync;
+		}
+		if (markers_init(&markers, cap.clock, opt.marker_index) != 0) {
+			fprintf(stderr, "Error: Could not create %s: %s\n", opt.marker_index, strerror(errno));
+			return 1;
+		}
+		cap.markers = &markers;
+		if (opt.serial_spec && line_reader_start(&serial, "serial", opt.serial_spec, &markers) != 0) {
+			fprintf(stderr, "Error: Could not open %s: %s\n", opt.serial_spec, strerror(errno));
+			return 1;
+		}
+		if (opt.control_path && line_reader_start(&control, "control", opt.control_path, &markers) != 0) {
+			fprintf(stderr, "Error: Could not open %s: %s\n", opt.control_path, strerror(errno));
+			if (opt.serial_spec)
+				line_reader_stop(&serial);
+			return 1;
+		}
+		printf("#Markers:%s%s%s%s (timestamp, source, text)\n", opt.serial_spec ? " serial " : "",
+		       opt.serial_spec ? serial.path : "", opt.control_path ? " control " : "",
+		       opt.control_path ? control.path : "");
+	} else if (opt.marker_index) {
+		fprintf(stderr, "Error: --marker-index needs --serial or --control.\n");
+		return 1;
+	}
+
+	if (opt.watch_spec) {
+		if (opt.region) {
+			fprintf(stderr, "Error: --watch can't be combined with --region.\n");
+			return 1;
+		}
+		if (watch_init(&watch, opt.watch_spec, opt.watch_interval) != 0) {
+			fprintf(stderr, "Error: Bad variable list '%s' for --watch.\n", opt.watch_spec);
+			return 1;
+		}
+		cap.watch = &watch;
+		printf("#Watch: %u variables, one %" PRIu32 "-byte read every %u ms (timestamp, values)\n",
+		       watch.nvars, watch.span, watch.interval_ms);
+	}
+
+	if (opt.trigger_level) {
+		if (trigger_init(&trigger, (uint32_t)strtoul(opt.trigger_level, NULL, 0),
+		                 opt.trigger_pre, opt.trigger_post, opt.trigger_holdoff) != 0) {
+			fprintf(stderr, "Error: Could not allocate the pre-trigger buffer.\n");
+			return 1;
+		}
+		trigger.falling = opt.trigger_falling;
+		trigger.single = opt.trigger_single;
+		cap.trigger = &trigger;
+		printf("#Trigger: %s edge through %" PRIu32 " nA, %" PRIu32 " pre, %" PRIu32 " post, %"
+		       PRIu32 " holdoff samples%s\n", trigger.falling ? "falling" : "rising", trigger.level,
+		       trigger.pre, trigger.post, trigger.holdoff, trigger.single ? ", single" : "");
+	}
+
+	if (opt.segments) {
+		memset(&segments, 0, sizeof(segments));
+		segments.out = &cap.out;
+		segmenter_init(&segments.seg, opt.segment_low, opt.segment_high, segment_log_row, &segments);
+		cap.segments = &segments;
+		printf("#Segments: active from %" PRIu32 " nA down to %" PRIu32 " nA\n",
+		       opt.segment_high, opt.segment_low);
+		printf("#start,duration,active,energy,peak_current,mean_current\n");
+	}
+
+	cap.pyramid = NULL;
+	if (opt.pyramid_prefix) {
+		if (pyramid_open(&pyramid, opt.pyramid_prefix) != 0)
+			return 1;
+		cap.pyramid = &pyramid;
+	}
+
+#ifndef _WIN32
+	cap.bcast = NULL;
+	if (opt.shm_name || opt.serve_path) {
+		if (bcast_create(&bcast, opt.shm_name) != 0) {
+			fprintf(stderr, "Error: Could not create broadcast ring: %s\n", strerror(errno));
+			return 1;
+		}
+		cap.bcast = &bcast;
+	}
+	if (opt.serve_path) {
+		if (server_start(&server, opt.serve_path, &bcast) != 0) {
+			fprintf(stderr, "Error: Could not listen on %s: %s\n", opt.serve_path, strerror(errno));
+			return 1;
+		}
+		printf("#Serving samples on %s\n", opt.serve_path);
+	}
+#endif
+
+	// Samples bypass stdio from here on, so push out the header first.
+	fflush(stdout);
+	if (sink_open(&cap.out, fileno(stdout), opt.writer) != 0) {
+		fprintf(stderr, "Error: Could not allocate output buffers.\n");
+		return 1;
+	}
+	mutex_init(&cap.lock);
+
+	// Region runs keep JTAG so the breakpoints can halt the target, watch runs to read memory.
+	// Plans set the run mode per phase.
+	if (!cap.region && !cap.phases)
+		MSP430_Run(FREE_RUN, cap.watch ? 0 : 1);
+	if (cap.watch && watch_start(&watch) != 0) {
+		fprintf(stderr, "Error: Could not start the watch thread.\n");
+		return 1;
+	}
+	status = MSP430_EnableEnergyTrace(&ets, &cbs, &ha);
+	capture_printf(&cap, "#MSP430_EnableEnergyTrace=%d\n", status);
+
+	status = MSP430_ResetEnergyTrace(ha);
+	capture_printf(&cap, "#MSP430_ResetEnergyTrace=%d\n", status);
+
+	if (cap.region)
+		iterations = region_measure(&region, opt.region_start, opt.region_stop, opt.iterations, duration,
+		                            opt.cycles, results);
+	else if (cap.phases)
+		started = plan_run(&phases, ha, vcc);
+	else
+		capture_wait(duration);
+	if (cap.watch)
+		watch_stop(&watch);
+	if (opt.serial_spec)
+		line_reader_stop(&serial);
+	if (opt.control_path)
+		line_reader_stop(&control);
+
+	status = MSP430_DisableEnergyTrace(ha);
+	if (cap.region || cap.watch || cap.phases)
+		MSP430_Run(FREE_RUN, 1);
+	if (cap.phases)
+		phases_close(&phases);
+	if (cap.segments)
+		segmenter_finish(&segments.seg, segments.last_timestamp);
+	if (cap.hist)
+		histograms_dump(&cap.out, cap.hist);
+	if (cap.psd)
+		psd_dump(&cap.out, cap.psd);
+	if (cap.markers)
+		markers_add(&markers, &cap.out, NULL, 0);
+	if (sink_close(&cap.out) != 0)
+		fprintf(stderr, "Error: Writing samples failed: %s\n", strerror(errno));
+	mutex_destroy(&cap.lock);
+	printf("#MSP430_DisableEnergyTrace=%d\n", status);
+	printf("#Output writer: %s\n", sink_kind_names[cap.out.kind]);
+	if (cap.summary)
+		summary_print(&summary, "Summary");
+	if (cap.segments)
+		segment_log_print(&segments);
+	if (cap.battery)
+		battery_print(&battery);
+	if (cap.autostop)
+		autostop_print(&autostop, duration);
+	if (cap.region) {
+		region_print(opt.region_start, opt.region_stop, results, iterations, opt.cycles);
+		if (iterations < opt.iterations)
+			printf("#  %u of %u iterations done; a breakpoint was not reached within %u s\n",
+			       iterations, opt.iterations, duration);
+		free(results);
+		mutex_destroy(&region.lock);
+	}
+	if (cap.phases) {
+		phases_print(&phases, started);
+		mutex_destroy(&phases.lock);
+	}
+	if (cap.clock)
+		clock_print(cap.clock);
+	if (cap.markers) {
+		printf("#Markers: %" PRIu64 " serial lines, %" PRIu64 " control lines, %" PRIu64 " written, %"
+		       PRIu64 " dropped\n", serial.lines, control.lines, markers.written, markers.dropped);
+		markers_free(&markers);
+	}
+	if (cap.watch) {
+		watch_print(&watch);
+		watch_free(&watch);
+	}
+	if (cap.psd) {
+		psd_print_peaks(&psd);
+		psd_free(&psd);
+	}
+	if (cap.trigger) {
+		printf("#Triggered %" PRIu64 " times\n", trigger.fired);
+		trigger_free(&trigger);
+	}
+	if (cap.pyramid) {
+		uint64_t buckets = pyramid.buckets;
+		if (pyramid_close(&pyramid) != 0)
+			fprintf(stderr, "Error: Writing pyramid %s failed.\n", opt.pyramid_prefix);
+		printf("#Pyramid: %" PRIu64 " level-1 buckets in %s.1 .. %s.%d\n",
+		       buckets, opt.pyramid_prefix, opt.pyramid_prefix, PYRAMID_LEVELS);
+	}
+#ifndef _WIN32
+	if (opt.serve_path) {
+		server_stop(&server);
+		printf("#Server: %d clients served, %" PRIu64 " dropped for falling behind\n",
+		       server.next_id, server.dropped_clients);
+	}
+	if (cap.bcast) {
+		if (opt.shm_name)
+			printf("#Published %" PRIu64 " blocks to shared memory %s\n", bcast.hdr->head, bcast.name);
+		bcast_close(&bcast);
+	}
+#endif
 
+	session_close();
 	return 0;
 }